@@ -0,0 +1,73 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif // defined(__cplusplus)
+
+    static int const WSVC_LIMITER_OK = 0;
+    static int const WSVC_LIMITER_ERROR = -1;
+    static int const WSVC_LIMITER_ERROR_INVALID_LIMITS = -2;
+    static int const WSVC_LIMITER_ERROR_FAILED_TO_CREATE_TIMER = -3;
+    static int const WSVC_LIMITER_ERROR_REJECTED = -4;
+
+    // Limits that a service registers with the concurrency limiter. The limiter samples the process resource usage
+    // every sample_interval_ms and adjusts the concurrency limit between min_concurrency and max_concurrency.
+    // A sample_interval_ms of 0 disables the timer, in which case the service drives wsvc_limiter_update itself.
+    // A cpu_target_percent or memory_limit_bytes of 0 disables the respective check. When memory_limit_bytes is set,
+    // memory_shed_percent must be between 1 and 100.
+    //
+    // Work that arrives while the limit is reached may wait for a slot. The admission queue holds up to
+    // queue_percent of the current concurrency limit, so it grows and shrinks with it; 0 disables queueing.
+    // If worker_pool is set, its thread maximum is kept at the concurrency limit; its thread minimum should not be
+    // above min_concurrency.
+    struct wsvc_limiter_limits_
+    {
+        LONG min_concurrency;
+        LONG max_concurrency;
+        LONG initial_concurrency;
+        DWORD sample_interval_ms;
+        DWORD cpu_target_percent;
+        SIZE_T memory_limit_bytes;
+        DWORD memory_shed_percent;
+        DWORD queue_percent;
+        PTP_POOL worker_pool;
+    };
+
+    typedef struct wsvc_limiter_limits_ wsvc_limiter_limits;
+    typedef wsvc_limiter_limits* wsvc_limiter_limits_ptr;
+
+    struct wsvc_limiter_;
+
+    typedef struct wsvc_limiter_ wsvc_limiter;
+    typedef wsvc_limiter* wsvc_limiter_ptr;
+
+    void wsvc_limiter_get_default_limits(wsvc_limiter_limits_ptr pLimits);
+
+    int wsvc_limiter_create(wsvc_limiter_limits const* pLimits, wsvc_limiter_ptr* ppLimiter);
+
+    void wsvc_limiter_destroy(wsvc_limiter_ptr pLimiter);
+
+    // Admits one unit of work, waiting up to timeoutMs in the admission queue if the limit is reached. On success,
+    // pToken receives a value that must be passed back to wsvc_limiter_release once the work completes. Returns
+    // WSVC_LIMITER_ERROR_REJECTED when the work should be shed, including once the service has started stopping.
+    int wsvc_limiter_acquire(wsvc_limiter_ptr pLimiter, DWORD timeoutMs, LONGLONG* pToken);
+
+    void wsvc_limiter_release(wsvc_limiter_ptr pLimiter, LONGLONG token);
+
+    // Adjusts the concurrency limit from one sample of the process CPU usage (as a percentage of all processors)
+    // and commit charge, together with the latency of the work released since the previous update. Called by the
+    // limiter's timer when sample_interval_ms is set.
+    void wsvc_limiter_update(wsvc_limiter_ptr pLimiter, DWORD cpuPercent, SIZE_T memoryBytes);
+
+    LONG wsvc_limiter_get_concurrency(wsvc_limiter_ptr pLimiter);
+
+#if defined(__cplusplus)
+}
+// extern "C"
+#endif // defined(__cplusplus)
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <wsvc/snapshot.h>
+
 #if defined(__cplusplus)
 extern "C"
 {
@@ -24,12 +26,24 @@ extern "C"
     static int const WSVC_SERVICE_RUN_OK = 0;
     static int const WSVC_SERVICE_RUN_ERROR = -1;
 
+    static int const WSVC_SERVICE_SNAPSHOT_HANDLER_OK = 0;
+    static int const WSVC_SERVICE_SNAPSHOT_HANDLER_ERROR = -1;
+    static int const WSVC_SERVICE_SNAPSHOT_HANDLER_ERROR_TOO_MANY_HANDLERS = -2;
+
+    // Called while the service is starting, after the snapshot from the previous run has been loaded. Handlers
+    // register the regions to be saved when the service stops and restore their state with
+    // wsvc_snapshot_restore; on a cold start every restore fails and the handler initializes its state from scratch.
+    typedef void (*wsvc_service_snapshot_handler)(wsvc_snapshot_ptr pSnapshot, LPVOID pContext);
+
     int wsvc_service_install();
 
     int wsvc_service_uninstall();
    
     int wsvc_service_run();
 
+    // Handlers are called in the order they were added. They must be added before wsvc_service_run.
+    int wsvc_service_add_snapshot_handler(wsvc_service_snapshot_handler handler, LPVOID pContext);
+
 #if defined(__cplusplus)
 }
 // extern "C"
@@ -0,0 +1,65 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif // defined(__cplusplus)
+
+    static int const WSVC_SNAPSHOT_OK = 0;
+    static int const WSVC_SNAPSHOT_ERROR = -1;
+    static int const WSVC_SNAPSHOT_ERROR_TOO_MANY_REGIONS = -2;
+    static int const WSVC_SNAPSHOT_ERROR_DUPLICATE_REGION = -3;
+    static int const WSVC_SNAPSHOT_ERROR_FAILED_TO_OPEN_FILE = -4;
+    static int const WSVC_SNAPSHOT_ERROR_FAILED_TO_MAP_FILE = -5;
+    static int const WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT = -6;
+    static int const WSVC_SNAPSHOT_ERROR_FAILED_TO_WRITE_FILE = -7;
+    static int const WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND = -8;
+
+    struct wsvc_snapshot_;
+
+    typedef struct wsvc_snapshot_ wsvc_snapshot;
+    typedef wsvc_snapshot* wsvc_snapshot_ptr;
+
+    // Called by wsvc_snapshot_save between regions and between chunks of large regions, so that a caller on a
+    // time-limited path can report that it is still making progress.
+    typedef void (*wsvc_snapshot_progress_callback)(LPVOID pContext);
+
+    int wsvc_snapshot_create(wsvc_snapshot_ptr* ppSnapshot);
+
+    void wsvc_snapshot_destroy(wsvc_snapshot_ptr pSnapshot);
+
+    // Registers a state region to be written by wsvc_snapshot_save. The memory at pData is only read during the
+    // save, so it must stay valid until then. regionVersion identifies the layout of the data and must match on
+    // restore.
+    int wsvc_snapshot_register(wsvc_snapshot_ptr pSnapshot, DWORD regionId, DWORD regionVersion, LPCVOID pData, SIZE_T size);
+
+    DWORD wsvc_snapshot_get_registered_count(wsvc_snapshot_ptr pSnapshot);
+
+    // Maps a snapshot written by a previous run. Any error means the caller should perform a cold start.
+    int wsvc_snapshot_load(wsvc_snapshot_ptr pSnapshot, LPCTSTR snapshotPath);
+
+    // Looks up a region from the loaded snapshot. The region checksum is validated on first access. On success,
+    // ppData points directly into the mapped file and stays valid until wsvc_snapshot_save or
+    // wsvc_snapshot_destroy.
+    int wsvc_snapshot_restore(wsvc_snapshot_ptr pSnapshot, DWORD regionId, DWORD regionVersion, LPCVOID* ppData, SIZE_T* pSize);
+
+    // Returns the number of regions from the loaded snapshot that have been restored successfully.
+    DWORD wsvc_snapshot_get_restored_count(wsvc_snapshot_ptr pSnapshot);
+
+    // Writes all registered regions to snapshotPath, replacing any previous snapshot. The loaded snapshot is
+    // unmapped as part of the save. progressCallback may be NULL.
+    int wsvc_snapshot_save(
+        wsvc_snapshot_ptr pSnapshot,
+        LPCTSTR snapshotPath,
+        wsvc_snapshot_progress_callback progressCallback,
+        LPVOID pProgressContext);
+
+#if defined(__cplusplus)
+}
+// extern "C"
+#endif // defined(__cplusplus)
@@ -0,0 +1,50 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif // defined(__cplusplus)
+
+    static int const WSVC_STATE_OK = 0;
+    static int const WSVC_STATE_ERROR = -1;
+    static int const WSVC_STATE_ERROR_INVALID_TRANSITION = -2;
+    static int const WSVC_STATE_ERROR_TOO_MANY_OBSERVERS = -3;
+
+    // The state before the service is first started. It is distinct from SERVICE_STOPPED so that a process which
+    // never runs as a service (for example the install and uninstall commands) is not reported as stopping.
+    static DWORD const WSVC_STATE_NOT_STARTED = 0;
+
+    // Called on the thread that performed the transition, after the new state has been published. Observers of
+    // transitions made concurrently on different threads may be called in either order.
+    typedef void (*wsvc_state_observer)(DWORD fromState, DWORD toState, DWORD checkpoint, LPVOID pContext);
+
+    // The service lifecycle state is held in a single word: the SERVICE_* state in the low byte and the SCM
+    // checkpoint in the remaining bits. The checkpoint is only non-zero in pending states.
+    LONG wsvc_state_get_word();
+
+    DWORD wsvc_state_word_get_state(LONG stateWord);
+
+    DWORD wsvc_state_word_get_checkpoint(LONG stateWord);
+
+    DWORD wsvc_state_get_current();
+
+    // Returns TRUE once a stop has been requested (SERVICE_STOP_PENDING) or the service has stopped after being
+    // started, so that work can be refused without any locking.
+    BOOL wsvc_state_is_stopping();
+
+    // Atomically moves to toState if the transition is allowed from the current state. Transitioning to the current
+    // pending state advances its checkpoint. On success, pStateWord (if not NULL) receives the new state word.
+    int wsvc_state_transition(DWORD toState, LONG* pStateWord);
+
+    // Observers cannot be removed and must stay valid for the lifetime of the process.
+    int wsvc_state_subscribe(wsvc_state_observer observer, LPVOID pContext);
+
+#if defined(__cplusplus)
+}
+// extern "C"
+#endif // defined(__cplusplus)
@@ -0,0 +1,502 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc/limiter.h>
+
+#include <wsvc/state.h>
+
+#include <stdbool.h>
+
+#include <Windows.h>
+#include <Psapi.h>
+
+static LONG const WSVC_LIMITER_DEFAULT_CONCURRENCY_PER_PROCESSOR = 4;
+static DWORD const WSVC_LIMITER_DEFAULT_SAMPLE_INTERVAL_MS = 1000;
+static DWORD const WSVC_LIMITER_DEFAULT_CPU_TARGET_PERCENT = 80;
+static DWORD const WSVC_LIMITER_DEFAULT_MEMORY_SHED_PERCENT = 90;
+static DWORD const WSVC_LIMITER_DEFAULT_QUEUE_PERCENT = 100;
+
+static DWORD const WSVC_LIMITER_MAX_QUEUE_PERCENT = 1000;
+
+// Average latency above this multiple of the baseline latency is treated as queueing. Windows does not expose
+// per-process run-queue latency, so the latency used here is the service time from wsvc_limiter_acquire to
+// wsvc_limiter_release; its growth against the baseline stands in for time spent waiting on the scheduler.
+static LONGLONG const WSVC_LIMITER_LATENCY_TOLERANCE = 2;
+
+// The baseline latency moves towards the observed latency by 1/N of the difference on each sample.
+static LONGLONG const WSVC_LIMITER_LATENCY_BASELINE_SMOOTHING = 16;
+
+// Latencies this short are dominated by timer resolution and scheduling noise, so the baseline is never taken to be
+// lower. This also keeps a baseline of 0 meaning that none has been taken yet.
+static LONGLONG const WSVC_LIMITER_LATENCY_BASELINE_FLOOR_US = 100;
+
+// Each release adds its latency in microseconds to the upper bits of the latency window and 1 to the lower bits,
+// so that the sampler takes the total and the count with a single exchange. A window holds up to 2^24 - 1 releases
+// and 2^40 - 1 microseconds of accumulated latency; once it is full, further releases are left out of the average
+// instead of overflowing into the neighbouring field.
+static int const WSVC_LIMITER_LATENCY_COUNT_BITS = 24;
+static ULONGLONG const WSVC_LIMITER_LATENCY_COUNT_MASK = 0xFFFFFF;
+static ULONGLONG const WSVC_LIMITER_LATENCY_TOTAL_MAX_US = 0xFFFFFFFFFF;
+static LONGLONG const WSVC_LIMITER_LATENCY_MAX_SAMPLE_US = 0xFFFFFFFF;
+
+struct wsvc_limiter_
+{
+    wsvc_limiter_limits limits;
+    PTP_TIMER timer;
+    DWORD processor_count;
+    LONG volatile concurrency;
+    LONG volatile in_flight;
+    LONG volatile shedding;
+    LONG volatile saturated;
+    LONG volatile sampling;
+    LONG volatile queued;
+    SRWLOCK queue_lock;
+    CONDITION_VARIABLE queue_available;
+    LONG64 volatile latency_window;
+    LONGLONG latency_baseline;
+    LONGLONG counter_frequency;
+    ULONGLONG last_cpu_time;
+    ULONGLONG last_interrupt_time;
+};
+
+static ULONGLONG wsvc_limiter_filetime_to_ulonglong(FILETIME const* pFileTime)
+{
+    ULARGE_INTEGER value;
+
+    value.LowPart = pFileTime->dwLowDateTime;
+    value.HighPart = pFileTime->dwHighDateTime;
+
+    return (value.QuadPart);
+}
+
+static DWORD wsvc_limiter_sample_cpu_percent(wsvc_limiter_ptr pLimiter)
+{
+    DWORD cpuPercent = 0;
+    FILETIME creationTime;
+    FILETIME exitTime;
+    FILETIME kernelTime;
+    FILETIME userTime;
+    ULONGLONG cpuTime = 0;
+    ULONGLONG interruptTime = 0;
+    ULONGLONG elapsedTime = 0;
+
+    if (GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime) != TRUE)
+        return (0);
+
+    // Interrupt time is monotonic and, unlike the system time, is not affected by clock adjustments. Both it and
+    // the process times are in 100 nanosecond units.
+    if (QueryUnbiasedInterruptTime(&interruptTime) != TRUE)
+        return (0);
+
+    cpuTime = wsvc_limiter_filetime_to_ulonglong(&kernelTime) + wsvc_limiter_filetime_to_ulonglong(&userTime);
+
+    if ((pLimiter->last_interrupt_time != 0) && (interruptTime > pLimiter->last_interrupt_time)) {
+        // CPU time is summed across all threads, so a fully loaded machine reports 100% rather than 100% per
+        // processor.
+        elapsedTime = (interruptTime - pLimiter->last_interrupt_time) * pLimiter->processor_count;
+        cpuPercent = (DWORD) (((cpuTime - pLimiter->last_cpu_time) * 100) / elapsedTime);
+    }
+
+    pLimiter->last_cpu_time = cpuTime;
+    pLimiter->last_interrupt_time = interruptTime;
+
+    return (cpuPercent);
+}
+
+static SIZE_T wsvc_limiter_sample_memory_bytes()
+{
+    PROCESS_MEMORY_COUNTERS memoryCounters;
+
+    ZeroMemory(&memoryCounters, sizeof(PROCESS_MEMORY_COUNTERS));
+
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memoryCounters, sizeof(PROCESS_MEMORY_COUNTERS)) != TRUE)
+        return (0);
+
+    // Commit charge is what job object and page file limits are enforced against.
+    return (memoryCounters.PagefileUsage);
+}
+
+static bool wsvc_limiter_is_shedding(wsvc_limiter_ptr pLimiter)
+{
+    return ((ReadAcquire(&(pLimiter->shedding)) != 0) || (wsvc_state_is_stopping() == TRUE));
+}
+
+static bool wsvc_limiter_try_admit(wsvc_limiter_ptr pLimiter)
+{
+    LONG inFlight = 0;
+
+    for (;;) {
+        inFlight = ReadAcquire(&(pLimiter->in_flight));
+
+        if (inFlight >= ReadAcquire(&(pLimiter->concurrency)))
+            return (false);
+
+        if (InterlockedCompareExchange(&(pLimiter->in_flight), inFlight + 1, inFlight) == inFlight)
+            return (true);
+    }
+}
+
+static void wsvc_limiter_wake(wsvc_limiter_ptr pLimiter, bool wakeAll)
+{
+    if (ReadAcquire(&(pLimiter->queued)) == 0)
+        return;
+
+    // A waiter holds the lock from its last failed admission check until it sleeps, so taking the lock here orders
+    // the wake after that check and it cannot be lost.
+    AcquireSRWLockExclusive(&(pLimiter->queue_lock));
+    ReleaseSRWLockExclusive(&(pLimiter->queue_lock));
+
+    if (wakeAll)
+        WakeAllConditionVariable(&(pLimiter->queue_available));
+    else
+        WakeConditionVariable(&(pLimiter->queue_available));
+}
+
+static bool wsvc_limiter_wait(wsvc_limiter_ptr pLimiter, DWORD timeoutMs)
+{
+    bool admitted = false;
+    LONG queued = 0;
+    LONG queueLength = 0;
+    ULONGLONG deadline = 0;
+    ULONGLONG now = 0;
+
+    queueLength = (LONG) (((LONGLONG) ReadAcquire(&(pLimiter->concurrency)) * pLimiter->limits.queue_percent) / 100);
+
+    for (;;) {
+        queued = ReadAcquire(&(pLimiter->queued));
+
+        if (queued >= queueLength)
+            return (false);
+
+        if (InterlockedCompareExchange(&(pLimiter->queued), queued + 1, queued) == queued)
+            break;
+    }
+
+    deadline = GetTickCount64() + timeoutMs;
+
+    AcquireSRWLockExclusive(&(pLimiter->queue_lock));
+
+    for (;;) {
+        if (wsvc_limiter_is_shedding(pLimiter))
+            break;
+
+        if (wsvc_limiter_try_admit(pLimiter)) {
+            admitted = true;
+            break;
+        }
+
+        now = GetTickCount64();
+        if (now >= deadline)
+            break;
+
+        // Timeouts and spurious wake-ups both fall through to the checks above.
+        SleepConditionVariableSRW(&(pLimiter->queue_available), &(pLimiter->queue_lock), (DWORD) (deadline - now), 0);
+    }
+
+    ReleaseSRWLockExclusive(&(pLimiter->queue_lock));
+
+    InterlockedDecrement(&(pLimiter->queued));
+
+    return (admitted);
+}
+
+static void wsvc_limiter_set_concurrency(wsvc_limiter_ptr pLimiter, LONG concurrency)
+{
+    LONG previousConcurrency = 0;
+
+    previousConcurrency = InterlockedExchange(&(pLimiter->concurrency), concurrency);
+
+    if ((pLimiter->limits.worker_pool != NULL) && (concurrency != previousConcurrency))
+        SetThreadpoolThreadMaximum(pLimiter->limits.worker_pool, (DWORD) concurrency);
+}
+
+static void wsvc_limiter_adjust(wsvc_limiter_ptr pLimiter, DWORD cpuPercent, SIZE_T memoryBytes)
+{
+    wsvc_limiter_limits const* pLimits = &(pLimiter->limits);
+    ULONGLONG latencyWindow = 0;
+    LONGLONG latencyTotal = 0;
+    LONGLONG latencyCount = 0;
+    LONGLONG latencyAverage = 0;
+    LONGLONG latencySample = 0;
+    LONG saturated = 0;
+    LONG concurrency = 0;
+    bool overloaded = false;
+
+    latencyWindow = (ULONGLONG) InterlockedExchange64(&(pLimiter->latency_window), 0);
+    latencyTotal = (LONGLONG) (latencyWindow >> WSVC_LIMITER_LATENCY_COUNT_BITS);
+    latencyCount = (LONGLONG) (latencyWindow & WSVC_LIMITER_LATENCY_COUNT_MASK);
+    saturated = InterlockedExchange(&(pLimiter->saturated), 0);
+    concurrency = ReadAcquire(&(pLimiter->concurrency));
+
+    do {
+        if (pLimits->memory_limit_bytes != 0) {
+            if (memoryBytes >= pLimits->memory_limit_bytes) {
+                InterlockedExchange(&(pLimiter->shedding), 1);
+                concurrency = pLimits->min_concurrency;
+                break;
+            }
+
+            InterlockedExchange(&(pLimiter->shedding), 0);
+
+            if (memoryBytes >= ((pLimits->memory_limit_bytes / 100) * pLimits->memory_shed_percent))
+                overloaded = true;
+        }
+
+        if ((pLimits->cpu_target_percent != 0) && (cpuPercent > pLimits->cpu_target_percent))
+            overloaded = true;
+
+        if (latencyCount > 0) {
+            latencyAverage = latencyTotal / latencyCount;
+
+            latencySample = latencyAverage;
+            if (latencySample < WSVC_LIMITER_LATENCY_BASELINE_FLOOR_US)
+                latencySample = WSVC_LIMITER_LATENCY_BASELINE_FLOOR_US;
+
+            if ((pLimiter->latency_baseline == 0) || (latencySample < pLimiter->latency_baseline)) {
+                pLimiter->latency_baseline = latencySample;
+            }
+            else {
+                pLimiter->latency_baseline +=
+                    (latencySample - pLimiter->latency_baseline) / WSVC_LIMITER_LATENCY_BASELINE_SMOOTHING;
+            }
+
+            if (latencyAverage > (pLimiter->latency_baseline * WSVC_LIMITER_LATENCY_TOLERANCE))
+                overloaded = true;
+        }
+
+        // Additive increase while the limit is the bottleneck, multiplicative decrease on any sign of overload.
+        if (overloaded) {
+            concurrency = (concurrency * 3) / 4;
+        }
+        else if (saturated != 0) {
+            concurrency = concurrency + 1;
+        }
+
+        if (concurrency < pLimits->min_concurrency)
+            concurrency = pLimits->min_concurrency;
+
+        if (concurrency > pLimits->max_concurrency)
+            concurrency = pLimits->max_concurrency;
+    }
+    while (false);
+
+    wsvc_limiter_set_concurrency(pLimiter, concurrency);
+
+    // Queued work is either admitted against a raised limit or rejected because the limiter started shedding.
+    wsvc_limiter_wake(pLimiter, true);
+}
+
+static VOID CALLBACK wsvc_limiter_timer_callback(PTP_CALLBACK_INSTANCE pInstance, PVOID pContext, PTP_TIMER pTimer)
+{
+    wsvc_limiter_ptr pLimiter = NULL;
+
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pTimer);
+
+    pLimiter = (wsvc_limiter_ptr) pContext;
+    if (pLimiter == NULL)
+        return;
+
+    // A periodic timer callback may overlap with a slow previous one; skip the sample rather than race on it.
+    if (InterlockedCompareExchange(&(pLimiter->sampling), 1, 0) != 0)
+        return;
+
+    wsvc_limiter_adjust(pLimiter, wsvc_limiter_sample_cpu_percent(pLimiter), wsvc_limiter_sample_memory_bytes());
+
+    InterlockedExchange(&(pLimiter->sampling), 0);
+}
+
+void wsvc_limiter_get_default_limits(wsvc_limiter_limits_ptr pLimits)
+{
+    SYSTEM_INFO systemInfo;
+
+    if (pLimits == NULL)
+        return;
+
+    ZeroMemory(&systemInfo, sizeof(SYSTEM_INFO));
+    GetSystemInfo(&systemInfo);
+
+    ZeroMemory(pLimits, sizeof(wsvc_limiter_limits));
+    pLimits->min_concurrency = 1;
+    pLimits->max_concurrency = (LONG) systemInfo.dwNumberOfProcessors * WSVC_LIMITER_DEFAULT_CONCURRENCY_PER_PROCESSOR;
+    pLimits->initial_concurrency = (LONG) systemInfo.dwNumberOfProcessors;
+    pLimits->sample_interval_ms = WSVC_LIMITER_DEFAULT_SAMPLE_INTERVAL_MS;
+    pLimits->cpu_target_percent = WSVC_LIMITER_DEFAULT_CPU_TARGET_PERCENT;
+    pLimits->memory_limit_bytes = 0;
+    pLimits->memory_shed_percent = WSVC_LIMITER_DEFAULT_MEMORY_SHED_PERCENT;
+    pLimits->queue_percent = WSVC_LIMITER_DEFAULT_QUEUE_PERCENT;
+    pLimits->worker_pool = NULL;
+}
+
+int wsvc_limiter_create(wsvc_limiter_limits const* pLimits, wsvc_limiter_ptr* ppLimiter)
+{
+    wsvc_limiter_ptr pLimiter = NULL;
+    SYSTEM_INFO systemInfo;
+    ULARGE_INTEGER dueTimeValue;
+    FILETIME dueTime;
+    LARGE_INTEGER counterFrequency;
+
+    if ((pLimits == NULL) || (ppLimiter == NULL))
+        return (WSVC_LIMITER_ERROR);
+
+    *ppLimiter = NULL;
+
+    if ((pLimits->min_concurrency < 1) ||
+        (pLimits->max_concurrency < pLimits->min_concurrency) ||
+        (pLimits->initial_concurrency < pLimits->min_concurrency) ||
+        (pLimits->initial_concurrency > pLimits->max_concurrency) ||
+        (pLimits->memory_shed_percent > 100) ||
+        (pLimits->queue_percent > WSVC_LIMITER_MAX_QUEUE_PERCENT) ||
+        ((pLimits->memory_limit_bytes != 0) && (pLimits->memory_shed_percent == 0)))
+        return (WSVC_LIMITER_ERROR_INVALID_LIMITS);
+
+    ZeroMemory(&counterFrequency, sizeof(LARGE_INTEGER));
+    QueryPerformanceFrequency(&counterFrequency);
+
+    pLimiter = (wsvc_limiter_ptr) malloc(sizeof(wsvc_limiter));
+    if (pLimiter == NULL)
+        return (WSVC_LIMITER_ERROR);
+
+    ZeroMemory(pLimiter, sizeof(wsvc_limiter));
+    ZeroMemory(&systemInfo, sizeof(SYSTEM_INFO));
+    GetSystemInfo(&systemInfo);
+
+    pLimiter->limits = *pLimits;
+    pLimiter->processor_count = (systemInfo.dwNumberOfProcessors == 0) ? 1 : systemInfo.dwNumberOfProcessors;
+    pLimiter->concurrency = pLimits->initial_concurrency;
+    pLimiter->counter_frequency = (counterFrequency.QuadPart == 0) ? 1 : counterFrequency.QuadPart;
+
+    InitializeSRWLock(&(pLimiter->queue_lock));
+    InitializeConditionVariable(&(pLimiter->queue_available));
+
+    if (pLimits->worker_pool != NULL)
+        SetThreadpoolThreadMaximum(pLimits->worker_pool, (DWORD) pLimits->initial_concurrency);
+
+    if (pLimits->sample_interval_ms == 0) {
+        *ppLimiter = pLimiter;
+        return (WSVC_LIMITER_OK);
+    }
+
+    // Prime the CPU counters so that the first timer sample has a delta to work with.
+    wsvc_limiter_sample_cpu_percent(pLimiter);
+
+    pLimiter->timer = CreateThreadpoolTimer(wsvc_limiter_timer_callback, (PVOID) pLimiter, NULL);
+    if (pLimiter->timer == NULL) {
+        free(pLimiter);
+        return (WSVC_LIMITER_ERROR_FAILED_TO_CREATE_TIMER);
+    }
+
+    // Negative due times are relative, in 100 nanosecond units.
+    dueTimeValue.QuadPart = (ULONGLONG) (-((LONGLONG) pLimits->sample_interval_ms * 10000));
+    dueTime.dwLowDateTime = dueTimeValue.LowPart;
+    dueTime.dwHighDateTime = dueTimeValue.HighPart;
+
+    SetThreadpoolTimer(pLimiter->timer, &dueTime, pLimits->sample_interval_ms, 0);
+
+    *ppLimiter = pLimiter;
+
+    return (WSVC_LIMITER_OK);
+}
+
+void wsvc_limiter_destroy(wsvc_limiter_ptr pLimiter)
+{
+    if (pLimiter == NULL)
+        return;
+
+    if (pLimiter->timer != NULL) {
+        SetThreadpoolTimer(pLimiter->timer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(pLimiter->timer, TRUE);
+        CloseThreadpoolTimer(pLimiter->timer);
+    }
+
+    free(pLimiter);
+}
+
+int wsvc_limiter_acquire(wsvc_limiter_ptr pLimiter, DWORD timeoutMs, LONGLONG* pToken)
+{
+    LARGE_INTEGER counter;
+
+    if ((pLimiter == NULL) || (pToken == NULL))
+        return (WSVC_LIMITER_ERROR);
+
+    if (wsvc_limiter_is_shedding(pLimiter))
+        return (WSVC_LIMITER_ERROR_REJECTED);
+
+    if (!wsvc_limiter_try_admit(pLimiter)) {
+        // Demand exceeded the limit during this sample window, which allows the limit to grow.
+        InterlockedExchange(&(pLimiter->saturated), 1);
+
+        if ((timeoutMs == 0) || !wsvc_limiter_wait(pLimiter, timeoutMs))
+            return (WSVC_LIMITER_ERROR_REJECTED);
+    }
+
+    QueryPerformanceCounter(&counter);
+    *pToken = counter.QuadPart;
+
+    return (WSVC_LIMITER_OK);
+}
+
+void wsvc_limiter_release(wsvc_limiter_ptr pLimiter, LONGLONG token)
+{
+    LARGE_INTEGER counter;
+    LONGLONG latency = 0;
+    LONGLONG latencyUs = 0;
+    ULONGLONG latencyWindow = 0;
+    ULONGLONG latencySample = 0;
+
+    if (pLimiter == NULL)
+        return;
+
+    QueryPerformanceCounter(&counter);
+
+    latency = (counter.QuadPart > token) ? (counter.QuadPart - token) : 0;
+
+    // Split into whole seconds and the remainder so that the conversion cannot overflow.
+    latencyUs =
+        ((latency / pLimiter->counter_frequency) * 1000000) +
+        (((latency % pLimiter->counter_frequency) * 1000000) / pLimiter->counter_frequency);
+
+    if (latencyUs > WSVC_LIMITER_LATENCY_MAX_SAMPLE_US)
+        latencyUs = WSVC_LIMITER_LATENCY_MAX_SAMPLE_US;
+
+    latencySample = ((ULONGLONG) latencyUs << WSVC_LIMITER_LATENCY_COUNT_BITS) | 1;
+
+    for (;;) {
+        latencyWindow = (ULONGLONG) ReadNoFence64(&(pLimiter->latency_window));
+
+        if (((latencyWindow & WSVC_LIMITER_LATENCY_COUNT_MASK) == WSVC_LIMITER_LATENCY_COUNT_MASK) ||
+            ((latencyWindow >> WSVC_LIMITER_LATENCY_COUNT_BITS) > (WSVC_LIMITER_LATENCY_TOTAL_MAX_US - (ULONGLONG) latencyUs)))
+            break;
+
+        if ((ULONGLONG) InterlockedCompareExchange64(
+                &(pLimiter->latency_window),
+                (LONG64) (latencyWindow + latencySample),
+                (LONG64) latencyWindow) == latencyWindow)
+            break;
+    }
+
+    InterlockedDecrement(&(pLimiter->in_flight));
+
+    wsvc_limiter_wake(pLimiter, false);
+}
+
+void wsvc_limiter_update(wsvc_limiter_ptr pLimiter, DWORD cpuPercent, SIZE_T memoryBytes)
+{
+    if (pLimiter == NULL)
+        return;
+
+    if (InterlockedCompareExchange(&(pLimiter->sampling), 1, 0) != 0)
+        return;
+
+    wsvc_limiter_adjust(pLimiter, cpuPercent, memoryBytes);
+
+    InterlockedExchange(&(pLimiter->sampling), 0);
+}
+
+LONG wsvc_limiter_get_concurrency(wsvc_limiter_ptr pLimiter)
+{
+    if (pLimiter == NULL)
+        return (0);
+
+    return (ReadAcquire(&(pLimiter->concurrency)));
+}
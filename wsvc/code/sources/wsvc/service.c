@@ -5,26 +5,52 @@
 
 #include <wsvc/console.h>
 #include <wsvc/eventlog.h>
+#include <wsvc/snapshot.h>
+#include <wsvc/state.h>
 #include <wsvc/wsvc.h>
 
 #include <stdbool.h>
+#include <strsafe.h>
 
 #include <Windows.h>
+#include <ShlObj.h>
 
 static DWORD const WSVC_SERVICE_EXIT_OK = 0;
 static DWORD const WSVC_SERVICE_EXIT_ERROR = (DWORD) -1;
 static DWORD const WSVC_SERVICE_EXIT_ERROR_STATUS_PROBLEM = (DWORD) -2;
 
+static LPCTSTR const WSVC_SERVICE_SNAPSHOT_FILE_NAME = TEXT("\\wsvc.snapshot");
+
+// The longest the SCM should wait for the next checkpoint while the service is starting or stopping. The snapshot
+// reports progress at least once per region and per chunk, each of which takes well under this.
+static DWORD const WSVC_SERVICE_WAIT_HINT_MS = 10000;
+
+#define WSVC_SERVICE_MAX_SNAPSHOT_HANDLERS 16
+
+struct wsvc_service_snapshot_handler_entry_
+{
+    wsvc_service_snapshot_handler handler;
+    LPVOID context;
+};
+
+typedef struct wsvc_service_snapshot_handler_entry_ wsvc_service_snapshot_handler_entry;
+
 struct wsvc_service_status_
 {
     SERVICE_STATUS_HANDLE status_handle;
     SERVICE_STATUS status;
-    DWORD checkpoint;
+    SRWLOCK status_lock;
+    wsvc_snapshot_ptr snapshot;
+    TCHAR snapshot_path[MAX_PATH];
 };
 
 typedef struct wsvc_service_status_ wsvc_service_status;
 typedef wsvc_service_status* wsvc_service_status_ptr;
 
+// Only written before the service control dispatcher starts, so the service threads read it without locking.
+static wsvc_service_snapshot_handler_entry wsvc_service_snapshot_handlers[WSVC_SERVICE_MAX_SNAPSHOT_HANDLERS];
+static DWORD wsvc_service_snapshot_handler_count = 0;
+
 static VOID WINAPI wsvc_service_main(DWORD argc, LPTSTR* pArgs);
 
 static BOOL WINAPI wsvc_service_set_status(wsvc_service_status_ptr pServiceStatus);
@@ -38,6 +64,10 @@ static DWORD WINAPI wsvc_service_control_handler(
 static DWORD WINAPI wsvc_service_start(wsvc_service_status_ptr pServiceStatus);
 static DWORD WINAPI wsvc_service_stop(wsvc_service_status_ptr pServiceStatus);
 
+static void wsvc_service_load_snapshot(wsvc_service_status_ptr pServiceStatus);
+static void wsvc_service_save_snapshot(wsvc_service_status_ptr pServiceStatus);
+static void wsvc_service_report_progress(LPVOID pContext);
+
 static VOID WINAPI wsvc_service_main(DWORD argc, LPTSTR* pArgs)
 {
     wsvc_service_status_ptr pServiceStatus = NULL;
@@ -54,14 +84,17 @@ static VOID WINAPI wsvc_service_main(DWORD argc, LPTSTR* pArgs)
     }
 
     ZeroMemory(pServiceStatus, sizeof(wsvc_service_status));
+    InitializeSRWLock(&(pServiceStatus->status_lock));
 
     pServiceStatus->status_handle = RegisterServiceCtrlHandlerEx(
         WSVC_APPLICATION_NAME,
         wsvc_service_control_handler,
         (LPVOID) pServiceStatus);
 
+    // Without a status handle there is no way to report to the SCM.
     if (pServiceStatus->status_handle == NULL) {
         wsvc_write_to_stderr(TEXT("[WSVC RUN] ERROR: Failed to register service control handler.\n"));
+        free(pServiceStatus);
         return;
     }
 
@@ -69,10 +102,20 @@ static VOID WINAPI wsvc_service_main(DWORD argc, LPTSTR* pArgs)
 
     ZeroMemory(pStatus, sizeof(SERVICE_STATUS));
     pStatus->dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-    pStatus->dwCurrentState = SERVICE_START_PENDING;
-    pStatus->dwControlsAccepted = SERVICE_ACCEPT_STOP;
-    
-    pServiceStatus->checkpoint = 1;
+
+    if (wsvc_state_transition(SERVICE_START_PENDING, NULL) != WSVC_STATE_OK) {
+        wsvc_write_to_stderr(TEXT("[WSVC RUN] ERROR: Service is not in a state that can be started.\n"));
+
+        // The state word still describes the earlier run, so this start's failure is reported directly rather than
+        // through wsvc_service_set_status.
+        pStatus->dwCurrentState = SERVICE_STOPPED;
+        pStatus->dwWin32ExitCode = ERROR_INVALID_STATE;
+
+        SetServiceStatus(pServiceStatus->status_handle, pStatus);
+
+        free(pServiceStatus);
+        return;
+    }
 
     setServiceStatusOk = wsvc_service_set_status(pServiceStatus);
 
@@ -86,6 +129,7 @@ static BOOL WINAPI wsvc_service_set_status(wsvc_service_status_ptr pServiceStatu
     BOOL setServiceStatusOk = FALSE;
     SERVICE_STATUS_HANDLE hStatus = NULL;
     LPSERVICE_STATUS pStatus = NULL;
+    LONG stateWord = 0;
 
     if (pServiceStatus == NULL) {
         wsvc_write_to_stderr(TEXT("[WSVC RUN] ERROR: wsvc_service_status_ptr was NULL when setting service status.\n"));
@@ -96,17 +140,23 @@ static BOOL WINAPI wsvc_service_set_status(wsvc_service_status_ptr pServiceStatu
 
     pStatus = &(pServiceStatus->status);
 
-    if ((pStatus->dwCurrentState == SERVICE_RUNNING) || (pStatus->dwCurrentState == SERVICE_STOPPED)) {
-        pStatus->dwCheckPoint = 0;
-    }
-    else {
-        pStatus->dwCheckPoint = (pServiceStatus->checkpoint)++;
-    }
+    // Transitions themselves are lock-free, but reports to the SCM are serialized and always carry the latest state
+    // so that a slower thread cannot overwrite a newer state with an older one.
+    AcquireSRWLockExclusive(&(pServiceStatus->status_lock));
+
+    stateWord = wsvc_state_get_word();
+
+    pStatus->dwCurrentState = wsvc_state_word_get_state(stateWord);
+    pStatus->dwCheckPoint = wsvc_state_word_get_checkpoint(stateWord);
+    pStatus->dwControlsAccepted = (pStatus->dwCurrentState == SERVICE_RUNNING) ? SERVICE_ACCEPT_STOP : 0;
+    pStatus->dwWaitHint = (pStatus->dwCheckPoint != 0) ? WSVC_SERVICE_WAIT_HINT_MS : 0;
 
     setServiceStatusOk = SetServiceStatus(
         hStatus,
         pStatus);
 
+    ReleaseSRWLockExclusive(&(pServiceStatus->status_lock));
+
     return (setServiceStatusOk);
 }
 
@@ -144,13 +194,26 @@ static DWORD WINAPI wsvc_service_start(wsvc_service_status_ptr pServiceStatus)
         wsvc_write_to_stderr(TEXT("[WSVC RUN] ERROR: Invalid wsvc_service_status_ptr while starting the service.\n"));
         return (WSVC_SERVICE_EXIT_ERROR_STATUS_PROBLEM);
     }
-    
-    pServiceStatus->status.dwCurrentState = SERVICE_START_PENDING;
+
+    wsvc_state_transition(SERVICE_START_PENDING, NULL);
     wsvc_service_set_status(pServiceStatus);
 
+    wsvc_service_load_snapshot(pServiceStatus);
+
+    if (wsvc_state_transition(SERVICE_RUNNING, NULL) != WSVC_STATE_OK) {
+        wsvc_write_event_log(EVENTLOG_ERROR_TYPE, TEXT("[WSVC] Service failed to enter the running state."));
+
+        wsvc_snapshot_destroy(pServiceStatus->snapshot);
+        pServiceStatus->snapshot = NULL;
+
+        wsvc_state_transition(SERVICE_STOPPED, NULL);
+        wsvc_service_set_status(pServiceStatus);
+
+        return (WSVC_SERVICE_EXIT_ERROR);
+    }
+
     wsvc_write_event_log(EVENTLOG_SUCCESS, TEXT("[WSVC] Service is running."));
 
-    pServiceStatus->status.dwCurrentState = SERVICE_RUNNING;
     wsvc_service_set_status(pServiceStatus);
 
     return (WSVC_SERVICE_EXIT_OK);
@@ -163,17 +226,140 @@ static DWORD WINAPI wsvc_service_stop(wsvc_service_status_ptr pServiceStatus)
         return (WSVC_SERVICE_EXIT_ERROR_STATUS_PROBLEM);
     }
 
-    pServiceStatus->status.dwCurrentState = SERVICE_STOP_PENDING;
+    if (wsvc_state_transition(SERVICE_STOP_PENDING, NULL) != WSVC_STATE_OK) {
+        wsvc_write_to_stderr(TEXT("[WSVC RUN] ERROR: Service is not in a state that can be stopped.\n"));
+        return (WSVC_SERVICE_EXIT_ERROR);
+    }
+
     wsvc_service_set_status(pServiceStatus);
 
     wsvc_write_event_log(EVENTLOG_SUCCESS, TEXT("[WSVC] Service is stopping."));
 
-    pServiceStatus->status.dwCurrentState = SERVICE_STOPPED;
+    wsvc_service_save_snapshot(pServiceStatus);
+
+    wsvc_state_transition(SERVICE_STOPPED, NULL);
     wsvc_service_set_status(pServiceStatus);
 
     return (WSVC_SERVICE_EXIT_OK);
 }
 
+static void wsvc_service_load_snapshot(wsvc_service_status_ptr pServiceStatus)
+{
+    #define WSVC_SERVICE_SNAPSHOT_MESSAGE_LENGTH 128
+
+    HRESULT folderResult = S_OK;
+    BOOL createDirectoryOk = FALSE;
+    bool pathOk = false;
+    DWORD restoredCount = 0;
+    DWORD index = 0;
+    TCHAR message[WSVC_SERVICE_SNAPSHOT_MESSAGE_LENGTH];
+
+    ZeroMemory(pServiceStatus->snapshot_path, sizeof(TCHAR) * _countof(pServiceStatus->snapshot_path));
+
+    if (wsvc_snapshot_create(&(pServiceStatus->snapshot)) != WSVC_SNAPSHOT_OK) {
+        wsvc_write_event_log(EVENTLOG_WARNING_TYPE, TEXT("[WSVC] Failed to create snapshot."));
+        return;
+    }
+
+    do {
+        // The snapshot lives in the service account's local application data rather than its temporary directory,
+        // which disk cleanup is free to empty between runs.
+        folderResult = SHGetFolderPath(
+            NULL,
+            CSIDL_LOCAL_APPDATA | CSIDL_FLAG_CREATE,
+            NULL,
+            SHGFP_TYPE_CURRENT,
+            pServiceStatus->snapshot_path);
+
+        if (FAILED(folderResult) ||
+            FAILED(StringCchCat(pServiceStatus->snapshot_path, _countof(pServiceStatus->snapshot_path), TEXT("\\"))) ||
+            FAILED(StringCchCat(pServiceStatus->snapshot_path, _countof(pServiceStatus->snapshot_path), WSVC_APPLICATION_NAME))) {
+            wsvc_write_event_log(EVENTLOG_WARNING_TYPE, TEXT("[WSVC] Failed to resolve the snapshot path."));
+            break;
+        }
+
+        createDirectoryOk = CreateDirectory(pServiceStatus->snapshot_path, NULL);
+
+        if ((createDirectoryOk != TRUE) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+            wsvc_write_event_log(EVENTLOG_WARNING_TYPE, TEXT("[WSVC] Failed to create the snapshot directory."));
+            break;
+        }
+
+        if (FAILED(StringCchCat(pServiceStatus->snapshot_path, _countof(pServiceStatus->snapshot_path), WSVC_SERVICE_SNAPSHOT_FILE_NAME))) {
+            wsvc_write_event_log(EVENTLOG_WARNING_TYPE, TEXT("[WSVC] Failed to resolve the snapshot path."));
+            break;
+        }
+
+        pathOk = true;
+
+        // A missing or invalid snapshot leaves nothing to restore, so the handlers below perform a cold start.
+        wsvc_snapshot_load(pServiceStatus->snapshot, pServiceStatus->snapshot_path);
+    }
+    while (false);
+
+    // Without a path there is nowhere to save to, but handlers are still called so that they initialize their state.
+    if (!pathOk)
+        ZeroMemory(pServiceStatus->snapshot_path, sizeof(TCHAR) * _countof(pServiceStatus->snapshot_path));
+
+    for (index = 0; index < wsvc_service_snapshot_handler_count; ++index) {
+        wsvc_service_snapshot_handlers[index].handler(pServiceStatus->snapshot, wsvc_service_snapshot_handlers[index].context);
+
+        wsvc_state_transition(SERVICE_START_PENDING, NULL);
+        wsvc_service_set_status(pServiceStatus);
+    }
+
+    restoredCount = wsvc_snapshot_get_restored_count(pServiceStatus->snapshot);
+
+    if (restoredCount == 0) {
+        wsvc_write_event_log(EVENTLOG_INFORMATION_TYPE, TEXT("[WSVC] No state restored from snapshot, performing a cold start."));
+        return;
+    }
+
+    ZeroMemory(message, sizeof(TCHAR) * WSVC_SERVICE_SNAPSHOT_MESSAGE_LENGTH);
+
+    StringCchPrintf(
+        message,
+        WSVC_SERVICE_SNAPSHOT_MESSAGE_LENGTH,
+        TEXT("[WSVC] Performing a warm start, restored %lu region(s) from snapshot."),
+        restoredCount);
+
+    wsvc_write_event_log(EVENTLOG_INFORMATION_TYPE, message);
+}
+
+static void wsvc_service_save_snapshot(wsvc_service_status_ptr pServiceStatus)
+{
+    DWORD registeredCount = 0;
+
+    if (pServiceStatus->snapshot == NULL)
+        return;
+
+    registeredCount = wsvc_snapshot_get_registered_count(pServiceStatus->snapshot);
+
+    if ((registeredCount != 0) && (pServiceStatus->snapshot_path[0] != TEXT('\0'))) {
+        if (wsvc_snapshot_save(
+                pServiceStatus->snapshot,
+                pServiceStatus->snapshot_path,
+                wsvc_service_report_progress,
+                (LPVOID) pServiceStatus) != WSVC_SNAPSHOT_OK) {
+            wsvc_write_event_log(EVENTLOG_WARNING_TYPE, TEXT("[WSVC] Failed to save snapshot."));
+        }
+    }
+
+    wsvc_snapshot_destroy(pServiceStatus->snapshot);
+    pServiceStatus->snapshot = NULL;
+
+    // With nothing registered, a snapshot left over from an earlier run would restore state older than this run.
+    if ((registeredCount == 0) && (pServiceStatus->snapshot_path[0] != TEXT('\0')))
+        DeleteFile(pServiceStatus->snapshot_path);
+}
+
+static void wsvc_service_report_progress(LPVOID pContext)
+{
+    // Advances the stop checkpoint so the SCM does not consider a long save hung.
+    wsvc_state_transition(SERVICE_STOP_PENDING, NULL);
+    wsvc_service_set_status((wsvc_service_status_ptr) pContext);
+}
+
 int wsvc_service_install()
 {
     static LPCTSTR const WSVC_SERVICE_USER_ACCOUNT = TEXT("NT AUTHORITY\\LocalService");
@@ -305,6 +491,22 @@ int wsvc_service_uninstall()
     return (result);
 }
 
+int wsvc_service_add_snapshot_handler(wsvc_service_snapshot_handler handler, LPVOID pContext)
+{
+    if (handler == NULL)
+        return (WSVC_SERVICE_SNAPSHOT_HANDLER_ERROR);
+
+    if (wsvc_service_snapshot_handler_count >= WSVC_SERVICE_MAX_SNAPSHOT_HANDLERS)
+        return (WSVC_SERVICE_SNAPSHOT_HANDLER_ERROR_TOO_MANY_HANDLERS);
+
+    wsvc_service_snapshot_handlers[wsvc_service_snapshot_handler_count].handler = handler;
+    wsvc_service_snapshot_handlers[wsvc_service_snapshot_handler_count].context = pContext;
+
+    ++wsvc_service_snapshot_handler_count;
+
+    return (WSVC_SERVICE_SNAPSHOT_HANDLER_OK);
+}
+
 int wsvc_service_run()
 {
     BOOL startOk = FALSE;
@@ -0,0 +1,611 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc/snapshot.h>
+
+#include <stdbool.h>
+#include <string.h>
+#include <strsafe.h>
+
+#include <Windows.h>
+
+#define WSVC_SNAPSHOT_MAX_REGIONS 32
+
+// "WSVC" when read as little endian bytes.
+static DWORD const WSVC_SNAPSHOT_MAGIC = 0x43565357;
+
+// Bump whenever the layout of wsvc_snapshot_header or wsvc_snapshot_region_entry changes.
+static DWORD const WSVC_SNAPSHOT_FORMAT_VERSION = 1;
+
+// Region data is aligned so that restored regions can be read in place without copying.
+static ULONGLONG const WSVC_SNAPSHOT_REGION_ALIGNMENT = 16;
+
+// Regions are checksummed and written in chunks of this size, with progress reported after each one. It also keeps
+// every WriteFile call within its DWORD length.
+static ULONGLONG const WSVC_SNAPSHOT_CHUNK_SIZE = 0x4000000;
+
+static BYTE const WSVC_SNAPSHOT_REGION_UNCHECKED = 0;
+static BYTE const WSVC_SNAPSHOT_REGION_VALID = 1;
+static BYTE const WSVC_SNAPSHOT_REGION_CORRUPT = 2;
+
+// On-disk layout: the header, followed by region_count region entries, followed by the region data. The header
+// checksum covers the header (with the checksum field zeroed) and the region entries. Each region entry carries
+// the checksum of its own data so that regions can be validated lazily.
+struct wsvc_snapshot_header_
+{
+    DWORD magic;
+    DWORD format_version;
+    DWORD region_count;
+    DWORD checksum;
+    ULONGLONG file_size;
+};
+
+typedef struct wsvc_snapshot_header_ wsvc_snapshot_header;
+
+struct wsvc_snapshot_region_entry_
+{
+    DWORD id;
+    DWORD version;
+    DWORD checksum;
+    DWORD reserved;
+    ULONGLONG offset;
+    ULONGLONG size;
+};
+
+typedef struct wsvc_snapshot_region_entry_ wsvc_snapshot_region_entry;
+
+struct wsvc_snapshot_registration_
+{
+    DWORD id;
+    DWORD version;
+    LPCVOID data;
+    SIZE_T size;
+};
+
+typedef struct wsvc_snapshot_registration_ wsvc_snapshot_registration;
+
+struct wsvc_snapshot_
+{
+    wsvc_snapshot_registration registrations[WSVC_SNAPSHOT_MAX_REGIONS];
+    DWORD registration_count;
+    LPCVOID view;
+    ULONGLONG view_size;
+    BYTE region_states[WSVC_SNAPSHOT_MAX_REGIONS];
+};
+
+// The checksum is computed eight bytes at a time (slice-by-8), since validating regions dominates the time to warm.
+// Table 0 is the standard byte-wise CRC-32 table; table n advances a byte's contribution by n further bytes.
+#define WSVC_SNAPSHOT_CRC32_SLICES 8
+
+static INIT_ONCE wsvc_snapshot_crc32_init_once = INIT_ONCE_STATIC_INIT;
+static DWORD wsvc_snapshot_crc32_table[WSVC_SNAPSHOT_CRC32_SLICES][256];
+
+static BOOL CALLBACK wsvc_snapshot_crc32_init(PINIT_ONCE pInitOnce, PVOID pParameter, PVOID* ppContext)
+{
+    DWORD index = 0;
+    DWORD bit = 0;
+    DWORD slice = 0;
+    DWORD value = 0;
+
+    UNREFERENCED_PARAMETER(pInitOnce);
+    UNREFERENCED_PARAMETER(pParameter);
+    UNREFERENCED_PARAMETER(ppContext);
+
+    for (index = 0; index < 256; ++index) {
+        value = index;
+
+        for (bit = 0; bit < 8; ++bit)
+            value = ((value & 1) != 0) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+
+        wsvc_snapshot_crc32_table[0][index] = value;
+    }
+
+    for (index = 0; index < 256; ++index) {
+        value = wsvc_snapshot_crc32_table[0][index];
+
+        for (slice = 1; slice < WSVC_SNAPSHOT_CRC32_SLICES; ++slice) {
+            value = wsvc_snapshot_crc32_table[0][value & 0xFF] ^ (value >> 8);
+            wsvc_snapshot_crc32_table[slice][index] = value;
+        }
+    }
+
+    return (TRUE);
+}
+
+static DWORD wsvc_snapshot_crc32(DWORD crc, LPCVOID pData, ULONGLONG size)
+{
+    BYTE const* pBytes = (BYTE const*) pData;
+    DWORD low = 0;
+    DWORD high = 0;
+
+    InitOnceExecuteOnce(&wsvc_snapshot_crc32_init_once, wsvc_snapshot_crc32_init, NULL, NULL);
+
+    crc = ~crc;
+
+    // Windows only runs little endian, so the first byte of each word lands in its low bits.
+    while (size >= WSVC_SNAPSHOT_CRC32_SLICES) {
+        memcpy(&low, pBytes, sizeof(DWORD));
+        memcpy(&high, pBytes + sizeof(DWORD), sizeof(DWORD));
+
+        low ^= crc;
+
+        crc =
+            wsvc_snapshot_crc32_table[7][low & 0xFF] ^
+            wsvc_snapshot_crc32_table[6][(low >> 8) & 0xFF] ^
+            wsvc_snapshot_crc32_table[5][(low >> 16) & 0xFF] ^
+            wsvc_snapshot_crc32_table[4][low >> 24] ^
+            wsvc_snapshot_crc32_table[3][high & 0xFF] ^
+            wsvc_snapshot_crc32_table[2][(high >> 8) & 0xFF] ^
+            wsvc_snapshot_crc32_table[1][(high >> 16) & 0xFF] ^
+            wsvc_snapshot_crc32_table[0][high >> 24];
+
+        pBytes += WSVC_SNAPSHOT_CRC32_SLICES;
+        size -= WSVC_SNAPSHOT_CRC32_SLICES;
+    }
+
+    while (size > 0) {
+        crc = wsvc_snapshot_crc32_table[0][(crc ^ *pBytes) & 0xFF] ^ (crc >> 8);
+
+        ++pBytes;
+        --size;
+    }
+
+    return (~crc);
+}
+
+static DWORD wsvc_snapshot_region_checksum(
+    LPCVOID pData,
+    ULONGLONG size,
+    wsvc_snapshot_progress_callback progressCallback,
+    LPVOID pProgressContext)
+{
+    BYTE const* pBytes = (BYTE const*) pData;
+    ULONGLONG chunkSize = 0;
+    DWORD crc = 0;
+
+    while (size > 0) {
+        chunkSize = (size > WSVC_SNAPSHOT_CHUNK_SIZE) ? WSVC_SNAPSHOT_CHUNK_SIZE : size;
+
+        crc = wsvc_snapshot_crc32(crc, pBytes, chunkSize);
+
+        pBytes += chunkSize;
+        size -= chunkSize;
+
+        if (progressCallback != NULL)
+            progressCallback(pProgressContext);
+    }
+
+    return (crc);
+}
+
+static DWORD wsvc_snapshot_header_checksum(
+    wsvc_snapshot_header const* pHeader,
+    wsvc_snapshot_region_entry const* pEntries)
+{
+    wsvc_snapshot_header header = *pHeader;
+    DWORD crc = 0;
+
+    header.checksum = 0;
+
+    crc = wsvc_snapshot_crc32(crc, &header, sizeof(wsvc_snapshot_header));
+    crc = wsvc_snapshot_crc32(crc, pEntries, sizeof(wsvc_snapshot_region_entry) * header.region_count);
+
+    return (crc);
+}
+
+static ULONGLONG wsvc_snapshot_align(ULONGLONG value)
+{
+    return ((value + WSVC_SNAPSHOT_REGION_ALIGNMENT - 1) & ~(WSVC_SNAPSHOT_REGION_ALIGNMENT - 1));
+}
+
+static wsvc_snapshot_region_entry const* wsvc_snapshot_get_entries(LPCVOID pView)
+{
+    return ((wsvc_snapshot_region_entry const*) ((BYTE const*) pView + sizeof(wsvc_snapshot_header)));
+}
+
+static bool wsvc_snapshot_validate(LPCVOID pView, ULONGLONG viewSize)
+{
+    wsvc_snapshot_header const* pHeader = (wsvc_snapshot_header const*) pView;
+    wsvc_snapshot_region_entry const* pEntries = NULL;
+    ULONGLONG tableEnd = 0;
+    DWORD index = 0;
+
+    if ((pHeader->magic != WSVC_SNAPSHOT_MAGIC) ||
+        (pHeader->format_version != WSVC_SNAPSHOT_FORMAT_VERSION) ||
+        (pHeader->file_size != viewSize) ||
+        (pHeader->region_count > WSVC_SNAPSHOT_MAX_REGIONS))
+        return (false);
+
+    tableEnd = sizeof(wsvc_snapshot_header) + (sizeof(wsvc_snapshot_region_entry) * pHeader->region_count);
+    if (tableEnd > viewSize)
+        return (false);
+
+    pEntries = wsvc_snapshot_get_entries(pView);
+
+    if (wsvc_snapshot_header_checksum(pHeader, pEntries) != pHeader->checksum)
+        return (false);
+
+    for (index = 0; index < pHeader->region_count; ++index) {
+        if ((pEntries[index].offset < tableEnd) ||
+            (pEntries[index].offset > viewSize) ||
+            (pEntries[index].size > (viewSize - pEntries[index].offset)))
+            return (false);
+    }
+
+    return (true);
+}
+
+static void wsvc_snapshot_unmap(wsvc_snapshot_ptr pSnapshot)
+{
+    if (pSnapshot->view != NULL)
+        UnmapViewOfFile(pSnapshot->view);
+
+    pSnapshot->view = NULL;
+    pSnapshot->view_size = 0;
+
+    ZeroMemory(pSnapshot->region_states, sizeof(pSnapshot->region_states));
+}
+
+static bool wsvc_snapshot_write(
+    HANDLE hFile,
+    LPCVOID pData,
+    ULONGLONG size,
+    wsvc_snapshot_progress_callback progressCallback,
+    LPVOID pProgressContext)
+{
+    BYTE const* pBytes = (BYTE const*) pData;
+    DWORD chunkSize = 0;
+    DWORD bytesWritten = 0;
+
+    while (size > 0) {
+        chunkSize = (DWORD) ((size > WSVC_SNAPSHOT_CHUNK_SIZE) ? WSVC_SNAPSHOT_CHUNK_SIZE : size);
+        bytesWritten = 0;
+
+        if ((WriteFile(hFile, (LPCVOID) pBytes, chunkSize, &bytesWritten, NULL) != TRUE) || (bytesWritten != chunkSize))
+            return (false);
+
+        pBytes += chunkSize;
+        size -= chunkSize;
+
+        if (progressCallback != NULL)
+            progressCallback(pProgressContext);
+    }
+
+    return (true);
+}
+
+static bool wsvc_snapshot_write_padding(HANDLE hFile, ULONGLONG currentOffset, ULONGLONG targetOffset)
+{
+    static BYTE const WSVC_SNAPSHOT_PADDING[16] = { 0 };
+
+    if (targetOffset <= currentOffset)
+        return (true);
+
+    return (wsvc_snapshot_write(hFile, WSVC_SNAPSHOT_PADDING, targetOffset - currentOffset, NULL, NULL));
+}
+
+int wsvc_snapshot_create(wsvc_snapshot_ptr* ppSnapshot)
+{
+    wsvc_snapshot_ptr pSnapshot = NULL;
+
+    if (ppSnapshot == NULL)
+        return (WSVC_SNAPSHOT_ERROR);
+
+    pSnapshot = (wsvc_snapshot_ptr) malloc(sizeof(wsvc_snapshot));
+    if (pSnapshot == NULL) {
+        *ppSnapshot = NULL;
+        return (WSVC_SNAPSHOT_ERROR);
+    }
+
+    ZeroMemory(pSnapshot, sizeof(wsvc_snapshot));
+
+    *ppSnapshot = pSnapshot;
+
+    return (WSVC_SNAPSHOT_OK);
+}
+
+void wsvc_snapshot_destroy(wsvc_snapshot_ptr pSnapshot)
+{
+    if (pSnapshot == NULL)
+        return;
+
+    wsvc_snapshot_unmap(pSnapshot);
+
+    free(pSnapshot);
+}
+
+int wsvc_snapshot_register(wsvc_snapshot_ptr pSnapshot, DWORD regionId, DWORD regionVersion, LPCVOID pData, SIZE_T size)
+{
+    wsvc_snapshot_registration* pRegistration = NULL;
+    DWORD index = 0;
+
+    if ((pSnapshot == NULL) || ((pData == NULL) && (size != 0)))
+        return (WSVC_SNAPSHOT_ERROR);
+
+    for (index = 0; index < pSnapshot->registration_count; ++index) {
+        if (pSnapshot->registrations[index].id == regionId)
+            return (WSVC_SNAPSHOT_ERROR_DUPLICATE_REGION);
+    }
+
+    if (pSnapshot->registration_count >= WSVC_SNAPSHOT_MAX_REGIONS)
+        return (WSVC_SNAPSHOT_ERROR_TOO_MANY_REGIONS);
+
+    pRegistration = &(pSnapshot->registrations[pSnapshot->registration_count]);
+    pRegistration->id = regionId;
+    pRegistration->version = regionVersion;
+    pRegistration->data = pData;
+    pRegistration->size = size;
+
+    ++(pSnapshot->registration_count);
+
+    return (WSVC_SNAPSHOT_OK);
+}
+
+DWORD wsvc_snapshot_get_registered_count(wsvc_snapshot_ptr pSnapshot)
+{
+    if (pSnapshot == NULL)
+        return (0);
+
+    return (pSnapshot->registration_count);
+}
+
+int wsvc_snapshot_load(wsvc_snapshot_ptr pSnapshot, LPCTSTR snapshotPath)
+{
+    int result = WSVC_SNAPSHOT_ERROR;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    HANDLE hMapping = NULL;
+    LPVOID pView = NULL;
+    LARGE_INTEGER fileSize;
+
+    if ((pSnapshot == NULL) || (snapshotPath == NULL))
+        return (WSVC_SNAPSHOT_ERROR);
+
+    wsvc_snapshot_unmap(pSnapshot);
+
+    hFile = CreateFile(
+        snapshotPath,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+        return (WSVC_SNAPSHOT_ERROR_FAILED_TO_OPEN_FILE);
+
+    do {
+        ZeroMemory(&fileSize, sizeof(LARGE_INTEGER));
+
+        if (GetFileSizeEx(hFile, &fileSize) != TRUE) {
+            result = WSVC_SNAPSHOT_ERROR_FAILED_TO_OPEN_FILE;
+            break;
+        }
+
+        if (fileSize.QuadPart < (LONGLONG) sizeof(wsvc_snapshot_header)) {
+            result = WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT;
+            break;
+        }
+
+        hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (hMapping == NULL) {
+            result = WSVC_SNAPSHOT_ERROR_FAILED_TO_MAP_FILE;
+            break;
+        }
+
+        pView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+
+        if (pView == NULL) {
+            result = WSVC_SNAPSHOT_ERROR_FAILED_TO_MAP_FILE;
+            break;
+        }
+
+        // Only the header and region table are validated here; region data is checked on first restore.
+        if (!wsvc_snapshot_validate(pView, (ULONGLONG) fileSize.QuadPart)) {
+            UnmapViewOfFile(pView);
+            result = WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT;
+            break;
+        }
+
+        pSnapshot->view = pView;
+        pSnapshot->view_size = (ULONGLONG) fileSize.QuadPart;
+        result = WSVC_SNAPSHOT_OK;
+    }
+    while (false);
+
+    // The view holds its own reference to the mapping, so neither handle is needed past this point.
+    if (hMapping != NULL)
+        CloseHandle(hMapping);
+
+    CloseHandle(hFile);
+
+    return (result);
+}
+
+int wsvc_snapshot_restore(wsvc_snapshot_ptr pSnapshot, DWORD regionId, DWORD regionVersion, LPCVOID* ppData, SIZE_T* pSize)
+{
+    wsvc_snapshot_header const* pHeader = NULL;
+    wsvc_snapshot_region_entry const* pEntries = NULL;
+    wsvc_snapshot_region_entry const* pEntry = NULL;
+    BYTE const* pRegionData = NULL;
+    DWORD index = 0;
+
+    if ((pSnapshot == NULL) || (ppData == NULL) || (pSize == NULL))
+        return (WSVC_SNAPSHOT_ERROR);
+
+    *ppData = NULL;
+    *pSize = 0;
+
+    if (pSnapshot->view == NULL)
+        return (WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND);
+
+    pHeader = (wsvc_snapshot_header const*) pSnapshot->view;
+    pEntries = wsvc_snapshot_get_entries(pSnapshot->view);
+
+    for (index = 0; index < pHeader->region_count; ++index) {
+        if (pEntries[index].id == regionId) {
+            pEntry = &(pEntries[index]);
+            break;
+        }
+    }
+
+    // A region written with a different layout version is treated as absent so that its owner starts cold.
+    if ((pEntry == NULL) || (pEntry->version != regionVersion))
+        return (WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND);
+
+    pRegionData = (BYTE const*) pSnapshot->view + pEntry->offset;
+
+    if (pSnapshot->region_states[index] == WSVC_SNAPSHOT_REGION_UNCHECKED) {
+        if (wsvc_snapshot_crc32(0, pRegionData, pEntry->size) == pEntry->checksum)
+            pSnapshot->region_states[index] = WSVC_SNAPSHOT_REGION_VALID;
+        else
+            pSnapshot->region_states[index] = WSVC_SNAPSHOT_REGION_CORRUPT;
+    }
+
+    if (pSnapshot->region_states[index] != WSVC_SNAPSHOT_REGION_VALID)
+        return (WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT);
+
+    *ppData = (LPCVOID) pRegionData;
+    *pSize = (SIZE_T) pEntry->size;
+
+    return (WSVC_SNAPSHOT_OK);
+}
+
+DWORD wsvc_snapshot_get_restored_count(wsvc_snapshot_ptr pSnapshot)
+{
+    DWORD restoredCount = 0;
+    DWORD index = 0;
+
+    if (pSnapshot == NULL)
+        return (0);
+
+    for (index = 0; index < WSVC_SNAPSHOT_MAX_REGIONS; ++index) {
+        if (pSnapshot->region_states[index] == WSVC_SNAPSHOT_REGION_VALID)
+            ++restoredCount;
+    }
+
+    return (restoredCount);
+}
+
+int wsvc_snapshot_save(
+    wsvc_snapshot_ptr pSnapshot,
+    LPCTSTR snapshotPath,
+    wsvc_snapshot_progress_callback progressCallback,
+    LPVOID pProgressContext)
+{
+    int result = WSVC_SNAPSHOT_ERROR;
+    TCHAR temporaryPath[MAX_PATH];
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    wsvc_snapshot_header header;
+    wsvc_snapshot_region_entry entries[WSVC_SNAPSHOT_MAX_REGIONS];
+    wsvc_snapshot_registration const* pRegistration = NULL;
+    ULONGLONG offset = 0;
+    DWORD index = 0;
+
+    if ((pSnapshot == NULL) || (snapshotPath == NULL))
+        return (WSVC_SNAPSHOT_ERROR);
+
+    ZeroMemory(temporaryPath, sizeof(TCHAR) * _countof(temporaryPath));
+
+    if (FAILED(StringCchPrintf(temporaryPath, _countof(temporaryPath), TEXT("%s.tmp"), snapshotPath)))
+        return (WSVC_SNAPSHOT_ERROR);
+
+    ZeroMemory(&header, sizeof(wsvc_snapshot_header));
+    ZeroMemory(entries, sizeof(entries));
+
+    offset = wsvc_snapshot_align(
+        sizeof(wsvc_snapshot_header) + (sizeof(wsvc_snapshot_region_entry) * pSnapshot->registration_count));
+
+    for (index = 0; index < pSnapshot->registration_count; ++index) {
+        pRegistration = &(pSnapshot->registrations[index]);
+
+        entries[index].id = pRegistration->id;
+        entries[index].version = pRegistration->version;
+        entries[index].checksum = wsvc_snapshot_region_checksum(
+            pRegistration->data,
+            pRegistration->size,
+            progressCallback,
+            pProgressContext);
+        entries[index].offset = offset;
+        entries[index].size = pRegistration->size;
+
+        offset = wsvc_snapshot_align(offset + pRegistration->size);
+    }
+
+    header.magic = WSVC_SNAPSHOT_MAGIC;
+    header.format_version = WSVC_SNAPSHOT_FORMAT_VERSION;
+    header.region_count = pSnapshot->registration_count;
+    header.file_size = offset;
+    header.checksum = wsvc_snapshot_header_checksum(&header, entries);
+
+    // Write to a temporary file first so that a crash mid-save never leaves a half-written snapshot behind.
+    hFile = CreateFile(
+        temporaryPath,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+        return (WSVC_SNAPSHOT_ERROR_FAILED_TO_OPEN_FILE);
+
+    do {
+        result = WSVC_SNAPSHOT_ERROR_FAILED_TO_WRITE_FILE;
+
+        if (!wsvc_snapshot_write(hFile, &header, sizeof(wsvc_snapshot_header), NULL, NULL))
+            break;
+
+        if (!wsvc_snapshot_write(hFile, entries, sizeof(wsvc_snapshot_region_entry) * header.region_count, NULL, NULL))
+            break;
+
+        offset = sizeof(wsvc_snapshot_header) + (sizeof(wsvc_snapshot_region_entry) * header.region_count);
+
+        for (index = 0; index < header.region_count; ++index) {
+            if (!wsvc_snapshot_write_padding(hFile, offset, entries[index].offset))
+                break;
+
+            if (!wsvc_snapshot_write(
+                    hFile,
+                    pSnapshot->registrations[index].data,
+                    entries[index].size,
+                    progressCallback,
+                    pProgressContext))
+                break;
+
+            offset = entries[index].offset + entries[index].size;
+        }
+
+        if (index != header.region_count)
+            break;
+
+        if (!wsvc_snapshot_write_padding(hFile, offset, header.file_size))
+            break;
+
+        if (FlushFileBuffers(hFile) != TRUE)
+            break;
+
+        result = WSVC_SNAPSHOT_OK;
+    }
+    while (false);
+
+    CloseHandle(hFile);
+
+    if (result != WSVC_SNAPSHOT_OK) {
+        DeleteFile(temporaryPath);
+        return (result);
+    }
+
+    // A mapped file cannot be replaced, so the previous snapshot is released only now that registered regions,
+    // which may point into it, have been written out.
+    wsvc_snapshot_unmap(pSnapshot);
+
+    if (MoveFileEx(temporaryPath, snapshotPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != TRUE) {
+        DeleteFile(temporaryPath);
+        return (WSVC_SNAPSHOT_ERROR_FAILED_TO_WRITE_FILE);
+    }
+
+    return (WSVC_SNAPSHOT_OK);
+}
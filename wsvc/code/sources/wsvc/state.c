@@ -0,0 +1,186 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc/state.h>
+
+#include <stdbool.h>
+
+#include <Windows.h>
+
+#define WSVC_STATE_MAX_OBSERVERS 16
+
+#define WSVC_STATE_BIT(state) (1 << (state))
+
+static LONG const WSVC_STATE_MASK = 0xFF;
+static int const WSVC_STATE_CHECKPOINT_SHIFT = 8;
+static LONG const WSVC_STATE_CHECKPOINT_MAX = 0x7FFFFF;
+
+// Allowed target states, indexed by the current state. Pending states may transition to themselves to advance the
+// checkpoint. A stop cannot be requested while starting; the start path either reaches SERVICE_RUNNING or fails
+// straight to SERVICE_STOPPED, so it never races a stop for the resources it is still setting up.
+static DWORD const WSVC_STATE_TRANSITIONS[] = {
+    // WSVC_STATE_NOT_STARTED
+    WSVC_STATE_BIT(SERVICE_START_PENDING),
+    // SERVICE_STOPPED
+    WSVC_STATE_BIT(SERVICE_START_PENDING),
+    // SERVICE_START_PENDING
+    WSVC_STATE_BIT(SERVICE_START_PENDING) | WSVC_STATE_BIT(SERVICE_RUNNING) | WSVC_STATE_BIT(SERVICE_STOPPED),
+    // SERVICE_STOP_PENDING
+    WSVC_STATE_BIT(SERVICE_STOP_PENDING) | WSVC_STATE_BIT(SERVICE_STOPPED),
+    // SERVICE_RUNNING
+    WSVC_STATE_BIT(SERVICE_STOP_PENDING) | WSVC_STATE_BIT(SERVICE_PAUSE_PENDING),
+    // SERVICE_CONTINUE_PENDING
+    WSVC_STATE_BIT(SERVICE_CONTINUE_PENDING) | WSVC_STATE_BIT(SERVICE_RUNNING) |
+        WSVC_STATE_BIT(SERVICE_STOP_PENDING),
+    // SERVICE_PAUSE_PENDING
+    WSVC_STATE_BIT(SERVICE_PAUSE_PENDING) | WSVC_STATE_BIT(SERVICE_PAUSED) |
+        WSVC_STATE_BIT(SERVICE_STOP_PENDING),
+    // SERVICE_PAUSED
+    WSVC_STATE_BIT(SERVICE_CONTINUE_PENDING) | WSVC_STATE_BIT(SERVICE_STOP_PENDING)
+};
+
+struct wsvc_state_observer_entry_
+{
+    wsvc_state_observer observer;
+    LPVOID context;
+    LONG volatile ready;
+};
+
+typedef struct wsvc_state_observer_entry_ wsvc_state_observer_entry;
+
+// Static initializers need a constant expression, so WSVC_STATE_NOT_STARTED is spelled out here.
+static LONG volatile wsvc_state_word = 0;
+
+static wsvc_state_observer_entry wsvc_state_observers[WSVC_STATE_MAX_OBSERVERS];
+static LONG volatile wsvc_state_observer_count = 0;
+
+static bool wsvc_state_is_pending(DWORD state)
+{
+    return (
+        (state == SERVICE_START_PENDING) ||
+        (state == SERVICE_STOP_PENDING) ||
+        (state == SERVICE_CONTINUE_PENDING) ||
+        (state == SERVICE_PAUSE_PENDING));
+}
+
+static bool wsvc_state_is_valid_transition(DWORD fromState, DWORD toState)
+{
+    if ((fromState >= _countof(WSVC_STATE_TRANSITIONS)) || (toState >= _countof(WSVC_STATE_TRANSITIONS)))
+        return (false);
+
+    return ((WSVC_STATE_TRANSITIONS[fromState] & WSVC_STATE_BIT(toState)) != 0);
+}
+
+static void wsvc_state_notify(DWORD fromState, LONG stateWord)
+{
+    LONG observerCount = 0;
+    LONG index = 0;
+    wsvc_state_observer_entry const* pEntry = NULL;
+
+    observerCount = ReadAcquire(&wsvc_state_observer_count);
+    if (observerCount > WSVC_STATE_MAX_OBSERVERS)
+        observerCount = WSVC_STATE_MAX_OBSERVERS;
+
+    for (index = 0; index < observerCount; ++index) {
+        pEntry = &(wsvc_state_observers[index]);
+
+        // A slot that has been claimed but not yet filled in is skipped. The acquire pairs with the exchange in
+        // wsvc_state_subscribe, so a ready slot is seen fully filled in.
+        if (ReadAcquire(&(pEntry->ready)) == 0)
+            continue;
+
+        pEntry->observer(
+            fromState,
+            wsvc_state_word_get_state(stateWord),
+            wsvc_state_word_get_checkpoint(stateWord),
+            pEntry->context);
+    }
+}
+
+LONG wsvc_state_get_word()
+{
+    return (ReadAcquire(&wsvc_state_word));
+}
+
+DWORD wsvc_state_word_get_state(LONG stateWord)
+{
+    return ((DWORD) (stateWord & WSVC_STATE_MASK));
+}
+
+DWORD wsvc_state_word_get_checkpoint(LONG stateWord)
+{
+    return ((DWORD) ((stateWord >> WSVC_STATE_CHECKPOINT_SHIFT) & WSVC_STATE_CHECKPOINT_MAX));
+}
+
+DWORD wsvc_state_get_current()
+{
+    return (wsvc_state_word_get_state(wsvc_state_get_word()));
+}
+
+BOOL wsvc_state_is_stopping()
+{
+    DWORD state = wsvc_state_get_current();
+
+    return (((state == SERVICE_STOP_PENDING) || (state == SERVICE_STOPPED)) ? TRUE : FALSE);
+}
+
+int wsvc_state_transition(DWORD toState, LONG* pStateWord)
+{
+    LONG oldWord = 0;
+    LONG newWord = 0;
+    DWORD fromState = 0;
+    LONG checkpoint = 0;
+
+    for (;;) {
+        // A stale read only costs a retry, since the compare-exchange below publishes newWord only over oldWord.
+        oldWord = ReadNoFence(&wsvc_state_word);
+        fromState = wsvc_state_word_get_state(oldWord);
+
+        if (!wsvc_state_is_valid_transition(fromState, toState))
+            return (WSVC_STATE_ERROR_INVALID_TRANSITION);
+
+        checkpoint = 0;
+
+        if (wsvc_state_is_pending(toState)) {
+            checkpoint = (fromState == toState) ? ((LONG) wsvc_state_word_get_checkpoint(oldWord) + 1) : 1;
+
+            if (checkpoint > WSVC_STATE_CHECKPOINT_MAX)
+                checkpoint = 1;
+        }
+
+        newWord = (checkpoint << WSVC_STATE_CHECKPOINT_SHIFT) | (LONG) toState;
+
+        if (InterlockedCompareExchange(&wsvc_state_word, newWord, oldWord) == oldWord)
+            break;
+    }
+
+    if (pStateWord != NULL)
+        *pStateWord = newWord;
+
+    wsvc_state_notify(fromState, newWord);
+
+    return (WSVC_STATE_OK);
+}
+
+int wsvc_state_subscribe(wsvc_state_observer observer, LPVOID pContext)
+{
+    LONG index = 0;
+
+    if (observer == NULL)
+        return (WSVC_STATE_ERROR);
+
+    // Claim a slot first, then publish it once filled in so that notifying threads never see a partial entry.
+    index = InterlockedIncrement(&wsvc_state_observer_count) - 1;
+
+    if (index >= WSVC_STATE_MAX_OBSERVERS) {
+        InterlockedDecrement(&wsvc_state_observer_count);
+        return (WSVC_STATE_ERROR_TOO_MANY_OBSERVERS);
+    }
+
+    wsvc_state_observers[index].observer = observer;
+    wsvc_state_observers[index].context = pContext;
+
+    InterlockedExchange(&(wsvc_state_observers[index].ready), 1);
+
+    return (WSVC_STATE_OK);
+}
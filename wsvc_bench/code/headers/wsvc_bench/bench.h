@@ -0,0 +1,28 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <Windows.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif // defined(__cplusplus)
+
+    // Returns the elapsed time between two performance counter readings in microseconds.
+    LONGLONG wsvc_bench_elapsed_us(LONGLONG startCounter, LONGLONG endCounter);
+
+    LONGLONG wsvc_bench_now();
+
+    // Runs a closed-loop synthetic load at increasing client counts, with and without the limiter, and prints the
+    // throughput and latency at each level.
+    void wsvc_bench_limiter();
+
+    // Compares rebuilding state from scratch against restoring it from a snapshot, at several state sizes.
+    void wsvc_bench_snapshot();
+
+#if defined(__cplusplus)
+}
+// extern "C"
+#endif // defined(__cplusplus)
@@ -0,0 +1,41 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_bench/bench.h>
+
+#include <stdio.h>
+#include <tchar.h>
+
+#include <Windows.h>
+
+static int const WSVC_BENCH_EXIT_OK = 0;
+static int const WSVC_BENCH_EXIT_ERROR = -1;
+
+static LPCTSTR const WSVC_BENCH_COMMAND_LIMITER = TEXT("limiter");
+static LPCTSTR const WSVC_BENCH_COMMAND_SNAPSHOT = TEXT("snapshot");
+
+int _tmain(int const argc, TCHAR const* const argv[], TCHAR const* const envp[])
+{
+    LPCTSTR commandStr = NULL;
+
+    UNREFERENCED_PARAMETER(envp);
+
+    // Without a command every benchmark runs.
+    if (argc >= 2)
+        commandStr = argv[1];
+
+    if ((commandStr == NULL) || (_tcsicmp(commandStr, WSVC_BENCH_COMMAND_LIMITER) == 0))
+        wsvc_bench_limiter();
+
+    if ((commandStr == NULL) || (_tcsicmp(commandStr, WSVC_BENCH_COMMAND_SNAPSHOT) == 0))
+        wsvc_bench_snapshot();
+
+    if ((commandStr != NULL) &&
+        (_tcsicmp(commandStr, WSVC_BENCH_COMMAND_LIMITER) != 0) &&
+        (_tcsicmp(commandStr, WSVC_BENCH_COMMAND_SNAPSHOT) != 0)) {
+        _tprintf(TEXT("[WSVC BENCH] Error: Unknown benchmark \"%s\".\n"), commandStr);
+        return (WSVC_BENCH_EXIT_ERROR);
+    }
+
+    return (WSVC_BENCH_EXIT_OK);
+}
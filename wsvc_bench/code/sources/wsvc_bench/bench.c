@@ -0,0 +1,33 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_bench/bench.h>
+
+static LONGLONG wsvc_bench_counter_frequency = 0;
+
+LONGLONG wsvc_bench_elapsed_us(LONGLONG startCounter, LONGLONG endCounter)
+{
+    LARGE_INTEGER frequency;
+    LONGLONG elapsed = 0;
+
+    if (wsvc_bench_counter_frequency == 0) {
+        ZeroMemory(&frequency, sizeof(LARGE_INTEGER));
+        QueryPerformanceFrequency(&frequency);
+        wsvc_bench_counter_frequency = (frequency.QuadPart == 0) ? 1 : frequency.QuadPart;
+    }
+
+    elapsed = (endCounter > startCounter) ? (endCounter - startCounter) : 0;
+
+    return (
+        ((elapsed / wsvc_bench_counter_frequency) * 1000000) +
+        (((elapsed % wsvc_bench_counter_frequency) * 1000000) / wsvc_bench_counter_frequency));
+}
+
+LONGLONG wsvc_bench_now()
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+
+    return (counter.QuadPart);
+}
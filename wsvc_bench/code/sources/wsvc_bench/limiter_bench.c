@@ -0,0 +1,236 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_bench/bench.h>
+#include <wsvc/limiter.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tchar.h>
+
+#include <Windows.h>
+
+// Each unit of synthetic work spins on the processor for this long, so that admitting more work than there are
+// processors only adds latency.
+static LONGLONG const WSVC_BENCH_LIMITER_WORK_US = 200;
+static DWORD const WSVC_BENCH_LIMITER_RUN_MS = 1500;
+static DWORD const WSVC_BENCH_LIMITER_SAMPLE_INTERVAL_MS = 100;
+static DWORD const WSVC_BENCH_LIMITER_ACQUIRE_TIMEOUT_MS = 50;
+static DWORD const WSVC_BENCH_LIMITER_RETRY_MS = 1;
+static LONG const WSVC_BENCH_LIMITER_CLIENTS_PER_PROCESSOR = 8;
+
+// Latencies are counted in buckets of WSVC_BENCH_LIMITER_BUCKET_US; the last bucket holds everything longer.
+#define WSVC_BENCH_LIMITER_BUCKET_US 10
+#define WSVC_BENCH_LIMITER_BUCKET_COUNT 20000
+#define WSVC_BENCH_LIMITER_MAX_CLIENTS MAXIMUM_WAIT_OBJECTS
+
+struct wsvc_bench_limiter_client_
+{
+    wsvc_limiter_ptr limiter;
+    LONG volatile* stop;
+    LONGLONG completed;
+    LONGLONG shed;
+    LONG buckets[WSVC_BENCH_LIMITER_BUCKET_COUNT];
+};
+
+typedef struct wsvc_bench_limiter_client_ wsvc_bench_limiter_client;
+typedef wsvc_bench_limiter_client* wsvc_bench_limiter_client_ptr;
+
+static void wsvc_bench_limiter_work()
+{
+    LONGLONG startCounter = wsvc_bench_now();
+
+    while (wsvc_bench_elapsed_us(startCounter, wsvc_bench_now()) < WSVC_BENCH_LIMITER_WORK_US)
+        YieldProcessor();
+}
+
+// A closed-loop client: issues the next unit of work as soon as the previous one completes. Shed work is retried
+// after a short back-off, as a caller would, and only admitted work is counted in the latency.
+static DWORD WINAPI wsvc_bench_limiter_client_proc(LPVOID lpParameter)
+{
+    wsvc_bench_limiter_client_ptr pClient = (wsvc_bench_limiter_client_ptr) lpParameter;
+    LONGLONG arrivalCounter = 0;
+    LONGLONG latencyUs = 0;
+    LONGLONG token = 0;
+    LONG bucket = 0;
+
+    while (ReadAcquire(pClient->stop) == 0) {
+        arrivalCounter = wsvc_bench_now();
+
+        if (pClient->limiter != NULL) {
+            if (wsvc_limiter_acquire(pClient->limiter, WSVC_BENCH_LIMITER_ACQUIRE_TIMEOUT_MS, &token) != WSVC_LIMITER_OK) {
+                pClient->shed++;
+                Sleep(WSVC_BENCH_LIMITER_RETRY_MS);
+                continue;
+            }
+        }
+
+        wsvc_bench_limiter_work();
+
+        if (pClient->limiter != NULL)
+            wsvc_limiter_release(pClient->limiter, token);
+
+        latencyUs = wsvc_bench_elapsed_us(arrivalCounter, wsvc_bench_now());
+        if (latencyUs >= ((LONGLONG) WSVC_BENCH_LIMITER_BUCKET_COUNT * WSVC_BENCH_LIMITER_BUCKET_US))
+            bucket = WSVC_BENCH_LIMITER_BUCKET_COUNT - 1;
+        else
+            bucket = (LONG) (latencyUs / WSVC_BENCH_LIMITER_BUCKET_US);
+
+        pClient->buckets[bucket]++;
+        pClient->completed++;
+    }
+
+    return (0);
+}
+
+// Returns the upper edge of the bucket holding the given percentile of the merged latencies.
+static LONGLONG wsvc_bench_limiter_percentile(LONGLONG const* pBuckets, LONGLONG total, LONGLONG percentile)
+{
+    LONGLONG rank = ((total * percentile) + 99) / 100;
+    LONGLONG seen = 0;
+    LONG i = 0;
+
+    for (i = 0; i < WSVC_BENCH_LIMITER_BUCKET_COUNT; ++i) {
+        seen += pBuckets[i];
+        if ((seen >= rank) && (seen != 0))
+            return ((LONGLONG) (i + 1) * WSVC_BENCH_LIMITER_BUCKET_US);
+    }
+
+    return (0);
+}
+
+static bool wsvc_bench_limiter_run(LONG clientCount, bool useLimiter)
+{
+    wsvc_bench_limiter_client_ptr clients[WSVC_BENCH_LIMITER_MAX_CLIENTS];
+    HANDLE threads[WSVC_BENCH_LIMITER_MAX_CLIENTS];
+    LONGLONG* pMerged = NULL;
+    wsvc_limiter_ptr pLimiter = NULL;
+    wsvc_limiter_limits limits;
+    LONG volatile stop = 0;
+    LONG started = 0;
+    LONGLONG completed = 0;
+    LONGLONG shed = 0;
+    LONGLONG startCounter = 0;
+    LONGLONG elapsedUs = 0;
+    LONG concurrency = 0;
+    LONG i = 0;
+    LONG j = 0;
+    bool result = false;
+
+    ZeroMemory(clients, sizeof(clients));
+    ZeroMemory(threads, sizeof(threads));
+
+    if (useLimiter) {
+        wsvc_limiter_get_default_limits(&limits);
+        limits.sample_interval_ms = WSVC_BENCH_LIMITER_SAMPLE_INTERVAL_MS;
+        if (wsvc_limiter_create(&limits, &pLimiter) != WSVC_LIMITER_OK) {
+            _tprintf(TEXT("[WSVC BENCH] Error: Failed to create the limiter.\n"));
+            return (false);
+        }
+    }
+
+    pMerged = (LONGLONG*) calloc(WSVC_BENCH_LIMITER_BUCKET_COUNT, sizeof(LONGLONG));
+    if (pMerged == NULL)
+        goto cleanup;
+
+    for (i = 0; i < clientCount; ++i) {
+        clients[i] = (wsvc_bench_limiter_client_ptr) calloc(1, sizeof(wsvc_bench_limiter_client));
+        if (clients[i] == NULL)
+            goto cleanup;
+
+        clients[i]->limiter = pLimiter;
+        clients[i]->stop = &stop;
+    }
+
+    startCounter = wsvc_bench_now();
+
+    for (started = 0; started < clientCount; ++started) {
+        threads[started] = CreateThread(NULL, 0, wsvc_bench_limiter_client_proc, clients[started], 0, NULL);
+        if (threads[started] == NULL)
+            break;
+    }
+
+    if (started == clientCount)
+        Sleep(WSVC_BENCH_LIMITER_RUN_MS);
+
+    InterlockedExchange(&stop, 1);
+
+    if (started > 0)
+        WaitForMultipleObjects((DWORD) started, threads, TRUE, INFINITE);
+
+    elapsedUs = wsvc_bench_elapsed_us(startCounter, wsvc_bench_now());
+
+    for (i = 0; i < started; ++i)
+        CloseHandle(threads[i]);
+
+    if (started != clientCount) {
+        _tprintf(TEXT("[WSVC BENCH] Error: Failed to start the clients.\n"));
+        goto cleanup;
+    }
+
+    if (pLimiter != NULL)
+        concurrency = wsvc_limiter_get_concurrency(pLimiter);
+
+    for (i = 0; i < clientCount; ++i) {
+        completed += clients[i]->completed;
+        shed += clients[i]->shed;
+        for (j = 0; j < WSVC_BENCH_LIMITER_BUCKET_COUNT; ++j)
+            pMerged[j] += clients[i]->buckets[j];
+    }
+
+    _tprintf(
+        TEXT("%-8s %8ld %12.0f %10lld %10lld %10lld %8ld\n"),
+        useLimiter ? TEXT("on") : TEXT("off"),
+        (long) clientCount,
+        (elapsedUs == 0) ? 0.0 : ((double) completed * 1000000.0) / (double) elapsedUs,
+        wsvc_bench_limiter_percentile(pMerged, completed, 50),
+        wsvc_bench_limiter_percentile(pMerged, completed, 99),
+        shed,
+        (long) concurrency);
+
+    result = true;
+
+cleanup:
+
+    for (i = 0; i < clientCount; ++i) {
+        if (clients[i] != NULL)
+            free(clients[i]);
+    }
+
+    if (pMerged != NULL)
+        free(pMerged);
+
+    if (pLimiter != NULL)
+        wsvc_limiter_destroy(pLimiter);
+
+    return (result);
+}
+
+void wsvc_bench_limiter()
+{
+    SYSTEM_INFO systemInfo;
+    LONG maxClients = 0;
+    LONG clientCount = 0;
+
+    ZeroMemory(&systemInfo, sizeof(SYSTEM_INFO));
+    GetSystemInfo(&systemInfo);
+
+    maxClients = (LONG) systemInfo.dwNumberOfProcessors * WSVC_BENCH_LIMITER_CLIENTS_PER_PROCESSOR;
+    if (maxClients > WSVC_BENCH_LIMITER_MAX_CLIENTS)
+        maxClients = WSVC_BENCH_LIMITER_MAX_CLIENTS;
+
+    _tprintf(
+        TEXT("[WSVC BENCH] Limiter: %lld us of work per request, %lu ms per run, %lu processor(s).\n"),
+        WSVC_BENCH_LIMITER_WORK_US,
+        (unsigned long) WSVC_BENCH_LIMITER_RUN_MS,
+        (unsigned long) systemInfo.dwNumberOfProcessors);
+    _tprintf(TEXT("%-8s %8s %12s %10s %10s %10s %8s\n"), TEXT("limiter"), TEXT("clients"), TEXT("ops/s"), TEXT("p50 us"), TEXT("p99 us"), TEXT("shed"), TEXT("limit"));
+
+    for (clientCount = 1; clientCount <= maxClients; clientCount *= 2) {
+        if (!wsvc_bench_limiter_run(clientCount, false))
+            return;
+        if (!wsvc_bench_limiter_run(clientCount, true))
+            return;
+    }
+}
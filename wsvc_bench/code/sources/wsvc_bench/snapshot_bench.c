@@ -0,0 +1,182 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_bench/bench.h>
+#include <wsvc/snapshot.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strsafe.h>
+#include <tchar.h>
+
+#include <Windows.h>
+
+static LPCTSTR const WSVC_BENCH_SNAPSHOT_FILE_NAME = TEXT("wsvc_bench.snapshot");
+
+static DWORD const WSVC_BENCH_SNAPSHOT_REGION_ID = 1;
+static DWORD const WSVC_BENCH_SNAPSHOT_REGION_VERSION = 1;
+
+// Each cold start rebuilds the state by running this many rounds of a mixing function over every element. It
+// stands in for whatever a real component computes on startup, so only its order of magnitude matters.
+static DWORD const WSVC_BENCH_SNAPSHOT_REBUILD_ROUNDS = 4;
+
+static SIZE_T const WSVC_BENCH_SNAPSHOT_SIZES_MB[] = { 1, 16, 128 };
+
+static SIZE_T const WSVC_BENCH_SNAPSHOT_PAGE_SIZE = 4096;
+
+// Receives the page reads so that they are not optimized away.
+static ULONGLONG volatile wsvc_bench_snapshot_sink = 0;
+
+static void wsvc_bench_snapshot_progress(LPVOID pContext)
+{
+    ++(*((LONG*) pContext));
+}
+
+static void wsvc_bench_snapshot_rebuild(ULONGLONG* pState, SIZE_T count)
+{
+    ULONGLONG value = 0;
+    SIZE_T index = 0;
+    DWORD round = 0;
+
+    for (index = 0; index < count; ++index) {
+        value = index;
+
+        for (round = 0; round < WSVC_BENCH_SNAPSHOT_REBUILD_ROUNDS; ++round) {
+            value += 0x9E3779B97F4A7C15;
+            value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+            value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+            value ^= value >> 31;
+        }
+
+        pState[index] = value;
+    }
+}
+
+// Reads one value per page so that the cost of faulting the mapped file in is counted.
+static ULONGLONG wsvc_bench_snapshot_touch(LPCVOID pData, SIZE_T size)
+{
+    BYTE const* pBytes = (BYTE const*) pData;
+    ULONGLONG sum = 0;
+    SIZE_T offset = 0;
+
+    for (offset = 0; offset < size; offset += WSVC_BENCH_SNAPSHOT_PAGE_SIZE)
+        sum += pBytes[offset];
+
+    return (sum);
+}
+
+static bool wsvc_bench_snapshot_run(LPCTSTR path, SIZE_T sizeMb)
+{
+    SIZE_T size = sizeMb * 1024 * 1024;
+    ULONGLONG* pState = NULL;
+    wsvc_snapshot_ptr pSnapshot = NULL;
+    LPCVOID pData = NULL;
+    SIZE_T restoredSize = 0;
+    LONG progressCount = 0;
+    LONGLONG startCounter = 0;
+    LONGLONG rebuildUs = 0;
+    LONGLONG saveUs = 0;
+    LONGLONG restoreUs = 0;
+    LONGLONG touchUs = 0;
+    bool result = false;
+
+    pState = (ULONGLONG*) malloc(size);
+    if (pState == NULL) {
+        _tprintf(TEXT("[WSVC BENCH] Error: Failed to allocate %lu MB of state.\n"), (unsigned long) sizeMb);
+        return (false);
+    }
+
+    do {
+        // Cold start: the state is computed from scratch.
+        startCounter = wsvc_bench_now();
+        wsvc_bench_snapshot_rebuild(pState, size / sizeof(ULONGLONG));
+        rebuildUs = wsvc_bench_elapsed_us(startCounter, wsvc_bench_now());
+
+        if (wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK)
+            break;
+
+        startCounter = wsvc_bench_now();
+
+        if ((wsvc_snapshot_register(pSnapshot, WSVC_BENCH_SNAPSHOT_REGION_ID, WSVC_BENCH_SNAPSHOT_REGION_VERSION, pState, size) != WSVC_SNAPSHOT_OK) ||
+            (wsvc_snapshot_save(pSnapshot, path, wsvc_bench_snapshot_progress, &progressCount) != WSVC_SNAPSHOT_OK)) {
+            _tprintf(TEXT("[WSVC BENCH] Error: Failed to save the snapshot.\n"));
+            break;
+        }
+
+        saveUs = wsvc_bench_elapsed_us(startCounter, wsvc_bench_now());
+
+        wsvc_snapshot_destroy(pSnapshot);
+        pSnapshot = NULL;
+
+        // Warm start: the state is mapped from the snapshot and validated on first restore.
+        startCounter = wsvc_bench_now();
+
+        if ((wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK) ||
+            (wsvc_snapshot_load(pSnapshot, path) != WSVC_SNAPSHOT_OK) ||
+            (wsvc_snapshot_restore(pSnapshot, WSVC_BENCH_SNAPSHOT_REGION_ID, WSVC_BENCH_SNAPSHOT_REGION_VERSION, &pData, &restoredSize) != WSVC_SNAPSHOT_OK) ||
+            (restoredSize != size)) {
+            _tprintf(TEXT("[WSVC BENCH] Error: Failed to restore the snapshot.\n"));
+            break;
+        }
+
+        restoreUs = wsvc_bench_elapsed_us(startCounter, wsvc_bench_now());
+
+        startCounter = wsvc_bench_now();
+        wsvc_bench_snapshot_sink = wsvc_bench_snapshot_touch(pData, restoredSize);
+        touchUs = wsvc_bench_elapsed_us(startCounter, wsvc_bench_now());
+
+        _tprintf(
+            TEXT("%8lu %12.2f %12.2f %8ld %12.2f %12.2f %12.2f\n"),
+            (unsigned long) sizeMb,
+            (double) rebuildUs / 1000.0,
+            (double) saveUs / 1000.0,
+            (long) progressCount,
+            (double) restoreUs / 1000.0,
+            (double) touchUs / 1000.0,
+            (double) (restoreUs + touchUs) / 1000.0);
+
+        result = true;
+    }
+    while (false);
+
+    wsvc_snapshot_destroy(pSnapshot);
+    free(pState);
+
+    DeleteFile(path);
+
+    return (result);
+}
+
+void wsvc_bench_snapshot()
+{
+    TCHAR path[MAX_PATH];
+    DWORD tempPathLength = 0;
+    SIZE_T index = 0;
+
+    ZeroMemory(path, sizeof(TCHAR) * _countof(path));
+
+    tempPathLength = GetTempPath(_countof(path), path);
+    if ((tempPathLength == 0) ||
+        (tempPathLength >= _countof(path)) ||
+        FAILED(StringCchCat(path, _countof(path), WSVC_BENCH_SNAPSHOT_FILE_NAME))) {
+        _tprintf(TEXT("[WSVC BENCH] Error: Failed to resolve the snapshot path.\n"));
+        return;
+    }
+
+    _tprintf(TEXT("[WSVC BENCH] Snapshot: time to warm from a single region, all times in ms.\n"));
+    _tprintf(
+        TEXT("%8s %12s %12s %8s %12s %12s %12s\n"),
+        TEXT("size MB"),
+        TEXT("cold build"),
+        TEXT("save"),
+        TEXT("progress"),
+        TEXT("restore"),
+        TEXT("first touch"),
+        TEXT("warm total"));
+
+    for (index = 0; index < _countof(WSVC_BENCH_SNAPSHOT_SIZES_MB); ++index) {
+        if (!wsvc_bench_snapshot_run(path, WSVC_BENCH_SNAPSHOT_SIZES_MB[index]))
+            return;
+    }
+}
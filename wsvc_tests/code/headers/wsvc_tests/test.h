@@ -0,0 +1,31 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <Windows.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif // defined(__cplusplus)
+
+    // Prints the result of a single check and counts it if it failed.
+    void wsvc_test_check(bool condition, LPCTSTR description);
+
+    int wsvc_test_get_failures();
+
+    void wsvc_test_limiter();
+
+    void wsvc_test_snapshot();
+
+    // Drives the process-wide service state through to SERVICE_STOPPED, so it must run after every suite that
+    // expects the service not to be stopping.
+    void wsvc_test_state();
+
+#if defined(__cplusplus)
+}
+// extern "C"
+#endif // defined(__cplusplus)
@@ -0,0 +1,31 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_tests/test.h>
+
+#include <stdio.h>
+#include <tchar.h>
+
+#include <Windows.h>
+
+static int const WSVC_TEST_EXIT_OK = 0;
+static int const WSVC_TEST_EXIT_ERROR = -1;
+
+int _tmain(int const argc, TCHAR const* const argv[], TCHAR const* const envp[])
+{
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+    UNREFERENCED_PARAMETER(envp);
+
+    wsvc_test_limiter();
+    wsvc_test_snapshot();
+    wsvc_test_state();
+
+    if (wsvc_test_get_failures() != 0) {
+        _tprintf(TEXT("[WSVC TEST] %d check(s) failed.\n"), wsvc_test_get_failures());
+        return (WSVC_TEST_EXIT_ERROR);
+    }
+
+    _tprintf(TEXT("[WSVC TEST] All checks passed.\n"));
+    return (WSVC_TEST_EXIT_OK);
+}
@@ -0,0 +1,355 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_tests/test.h>
+
+#include <wsvc/limiter.h>
+
+#include <Windows.h>
+
+#define WSVC_TEST_LIMITER_LOAD_THREAD_COUNT 8
+
+static LONG const WSVC_TEST_LIMITER_LOAD_OPERATIONS_PER_THREAD = 50;
+static LONG const WSVC_TEST_LIMITER_LOAD_CONCURRENCY = 2;
+static DWORD const WSVC_TEST_LIMITER_LOAD_TIMEOUT_MS = 10000;
+static DWORD const WSVC_TEST_LIMITER_LOAD_WORK_MS = 1;
+
+// Long enough to be far above any baseline taken from work that returns immediately.
+static DWORD const WSVC_TEST_LIMITER_SLOW_WORK_MS = 50;
+
+struct wsvc_test_limiter_load_
+{
+    wsvc_limiter_ptr limiter;
+    HANDLE start_event;
+    LONG volatile in_flight;
+    LONG volatile max_in_flight;
+    LONG volatile admitted;
+    LONG volatile rejected;
+};
+
+typedef struct wsvc_test_limiter_load_ wsvc_test_limiter_load;
+typedef wsvc_test_limiter_load* wsvc_test_limiter_load_ptr;
+
+// Limits with the timer disabled, so that each test decides exactly what every update sees.
+static void wsvc_test_limiter_get_manual_limits(wsvc_limiter_limits_ptr pLimits)
+{
+    wsvc_limiter_get_default_limits(pLimits);
+
+    pLimits->min_concurrency = 1;
+    pLimits->max_concurrency = 8;
+    pLimits->initial_concurrency = 4;
+    pLimits->sample_interval_ms = 0;
+    pLimits->cpu_target_percent = 80;
+    pLimits->memory_limit_bytes = 1000;
+    pLimits->memory_shed_percent = 90;
+    pLimits->queue_percent = 0;
+}
+
+// Acquires up to count slots without waiting and returns how many were admitted.
+static LONG wsvc_test_limiter_fill(wsvc_limiter_ptr pLimiter, LONGLONG* pTokens, LONG count)
+{
+    LONG admitted = 0;
+
+    while ((admitted < count) && (wsvc_limiter_acquire(pLimiter, 0, &(pTokens[admitted])) == WSVC_LIMITER_OK))
+        ++admitted;
+
+    return (admitted);
+}
+
+static void wsvc_test_limiter_drain(wsvc_limiter_ptr pLimiter, LONGLONG const* pTokens, LONG count)
+{
+    LONG index = 0;
+
+    for (index = 0; index < count; ++index)
+        wsvc_limiter_release(pLimiter, pTokens[index]);
+}
+
+static void wsvc_test_limiter_create()
+{
+    wsvc_limiter_limits limits;
+    wsvc_limiter_ptr pLimiter = NULL;
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.min_concurrency = 0;
+    wsvc_test_check(
+        wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_ERROR_INVALID_LIMITS,
+        TEXT("limiter refuses a minimum concurrency of 0"));
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.memory_shed_percent = 0;
+    wsvc_test_check(
+        wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_ERROR_INVALID_LIMITS,
+        TEXT("limiter refuses a shed percent of 0 with a memory limit"));
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.queue_percent = 100000;
+    wsvc_test_check(
+        wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_ERROR_INVALID_LIMITS,
+        TEXT("limiter refuses an oversized admission queue"));
+
+    wsvc_test_check(pLimiter == NULL, TEXT("limiter is not returned on invalid limits"));
+}
+
+static void wsvc_test_limiter_sampler()
+{
+    wsvc_limiter_limits limits;
+    wsvc_limiter_ptr pLimiter = NULL;
+    LONGLONG tokens[8];
+    LONG admitted = 0;
+    LONGLONG token = 0;
+
+    ZeroMemory(tokens, sizeof(tokens));
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    wsvc_test_check(wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_OK, TEXT("create a manually sampled limiter"));
+    if (pLimiter == NULL)
+        return;
+
+    wsvc_limiter_update(pLimiter, 10, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 4, TEXT("limit does not grow while demand is below it"));
+
+    admitted = wsvc_test_limiter_fill(pLimiter, tokens, _countof(tokens));
+    wsvc_test_check(admitted == 4, TEXT("acquire admits exactly the limit"));
+    wsvc_test_limiter_drain(pLimiter, tokens, admitted);
+
+    wsvc_limiter_update(pLimiter, 10, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 5, TEXT("limit grows by one after saturation"));
+
+    wsvc_limiter_update(pLimiter, 90, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 3, TEXT("limit is cut by a quarter above the CPU target"));
+
+    wsvc_limiter_update(pLimiter, 10, 950);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 2, TEXT("limit is cut above the memory shed percent"));
+
+    wsvc_limiter_update(pLimiter, 10, 1000);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 1, TEXT("limit drops to the minimum at the memory limit"));
+    wsvc_test_check(
+        wsvc_limiter_acquire(pLimiter, 0, &token) == WSVC_LIMITER_ERROR_REJECTED,
+        TEXT("all work is shed at the memory limit"));
+
+    wsvc_limiter_update(pLimiter, 10, 0);
+    wsvc_test_check(
+        wsvc_limiter_acquire(pLimiter, 0, &token) == WSVC_LIMITER_OK,
+        TEXT("work is admitted again below the memory limit"));
+    wsvc_limiter_release(pLimiter, token);
+
+    wsvc_limiter_update(pLimiter, 90, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 1, TEXT("limit never drops below the minimum"));
+
+    wsvc_limiter_destroy(pLimiter);
+}
+
+static void wsvc_test_limiter_latency()
+{
+    wsvc_limiter_limits limits;
+    wsvc_limiter_ptr pLimiter = NULL;
+    LONGLONG tokens[8];
+    LONG admitted = 0;
+    LONG index = 0;
+
+    ZeroMemory(tokens, sizeof(tokens));
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.cpu_target_percent = 0;
+    limits.memory_limit_bytes = 0;
+
+    wsvc_test_check(wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_OK, TEXT("create a latency-only limiter"));
+    if (pLimiter == NULL)
+        return;
+
+    // Fast work sets the baseline.
+    for (index = 0; index < 16; ++index) {
+        admitted = wsvc_test_limiter_fill(pLimiter, tokens, 1);
+        wsvc_test_limiter_drain(pLimiter, tokens, admitted);
+    }
+
+    wsvc_limiter_update(pLimiter, 0, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 4, TEXT("fast work does not cut the limit"));
+
+    admitted = wsvc_test_limiter_fill(pLimiter, tokens, 1);
+    Sleep(WSVC_TEST_LIMITER_SLOW_WORK_MS);
+    wsvc_test_limiter_drain(pLimiter, tokens, admitted);
+
+    wsvc_limiter_update(pLimiter, 0, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 3, TEXT("latency above the baseline cuts the limit"));
+
+    wsvc_limiter_update(pLimiter, 0, 0);
+    wsvc_test_check(wsvc_limiter_get_concurrency(pLimiter) == 3, TEXT("an empty window leaves the limit alone"));
+
+    wsvc_limiter_destroy(pLimiter);
+}
+
+// Releases whose latency would overflow the packed window are dropped rather than wrapping the total.
+static void wsvc_test_limiter_window_overflow()
+{
+    // The largest latency a single release can record is just under 2^32 microseconds, so this many of them leave
+    // less than 2^8 microseconds of room in the 2^40 microsecond total.
+    static LONG const WSVC_TEST_LIMITER_OVERFLOW_RELEASES = 256;
+
+    wsvc_limiter_limits limits;
+    wsvc_limiter_ptr pLimiter = NULL;
+    LARGE_INTEGER frequency;
+    LONGLONG token = 0;
+    LONG index = 0;
+    bool admitted = true;
+
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.cpu_target_percent = 0;
+    limits.memory_limit_bytes = 0;
+
+    ZeroMemory(&frequency, sizeof(LARGE_INTEGER));
+    QueryPerformanceFrequency(&frequency);
+
+    wsvc_test_check(wsvc_limiter_create(&limits, &pLimiter) == WSVC_LIMITER_OK, TEXT("create an overflow limiter"));
+    if (pLimiter == NULL)
+        return;
+
+    if (wsvc_limiter_acquire(pLimiter, 0, &token) == WSVC_LIMITER_OK)
+        wsvc_limiter_release(pLimiter, token);
+
+    wsvc_limiter_update(pLimiter, 0, 0);
+
+    for (index = 0; index <= WSVC_TEST_LIMITER_OVERFLOW_RELEASES; ++index) {
+        if (wsvc_limiter_acquire(pLimiter, 0, &token) != WSVC_LIMITER_OK) {
+            admitted = false;
+            break;
+        }
+
+        // The final release takes a millisecond, which would wrap the total to almost nothing.
+        if (index < WSVC_TEST_LIMITER_OVERFLOW_RELEASES)
+            wsvc_limiter_release(pLimiter, token - (frequency.QuadPart * 5000));
+        else
+            wsvc_limiter_release(pLimiter, token - (frequency.QuadPart / 1000));
+    }
+
+    wsvc_test_check(admitted, TEXT("every slow release was admitted"));
+
+    wsvc_limiter_update(pLimiter, 0, 0);
+    wsvc_test_check(
+        wsvc_limiter_get_concurrency(pLimiter) == 3,
+        TEXT("a full latency window still reports its slow average"));
+
+    wsvc_limiter_destroy(pLimiter);
+}
+
+static DWORD WINAPI wsvc_test_limiter_load_worker(LPVOID pParameter)
+{
+    wsvc_test_limiter_load_ptr pLoad = (wsvc_test_limiter_load_ptr) pParameter;
+    LONG index = 0;
+    LONG inFlight = 0;
+    LONG maxInFlight = 0;
+    LONGLONG token = 0;
+
+    WaitForSingleObject(pLoad->start_event, INFINITE);
+
+    for (index = 0; index < WSVC_TEST_LIMITER_LOAD_OPERATIONS_PER_THREAD; ++index) {
+        if ((pLoad->limiter != NULL) &&
+            (wsvc_limiter_acquire(pLoad->limiter, WSVC_TEST_LIMITER_LOAD_TIMEOUT_MS, &token) != WSVC_LIMITER_OK)) {
+            InterlockedIncrement(&(pLoad->rejected));
+            continue;
+        }
+
+        inFlight = InterlockedIncrement(&(pLoad->in_flight));
+
+        for (;;) {
+            maxInFlight = ReadAcquire(&(pLoad->max_in_flight));
+
+            if ((inFlight <= maxInFlight) ||
+                (InterlockedCompareExchange(&(pLoad->max_in_flight), inFlight, maxInFlight) == maxInFlight))
+                break;
+        }
+
+        Sleep(WSVC_TEST_LIMITER_LOAD_WORK_MS);
+
+        InterlockedDecrement(&(pLoad->in_flight));
+        InterlockedIncrement(&(pLoad->admitted));
+
+        if (pLoad->limiter != NULL)
+            wsvc_limiter_release(pLoad->limiter, token);
+    }
+
+    return (0);
+}
+
+// Pushes work from more threads than the limit allows, with or without the limiter in front of it.
+static bool wsvc_test_limiter_run_load(wsvc_test_limiter_load_ptr pLoad)
+{
+    bool result = true;
+    HANDLE threads[WSVC_TEST_LIMITER_LOAD_THREAD_COUNT];
+    DWORD threadCount = 0;
+
+    ZeroMemory(threads, sizeof(threads));
+
+    pLoad->start_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (pLoad->start_event == NULL)
+        return (false);
+
+    for (threadCount = 0; threadCount < WSVC_TEST_LIMITER_LOAD_THREAD_COUNT; ++threadCount) {
+        threads[threadCount] = CreateThread(NULL, 0, wsvc_test_limiter_load_worker, pLoad, 0, NULL);
+
+        if (threads[threadCount] == NULL) {
+            result = false;
+            break;
+        }
+    }
+
+    SetEvent(pLoad->start_event);
+
+    if (threadCount > 0)
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+    while (threadCount > 0)
+        CloseHandle(threads[--threadCount]);
+
+    CloseHandle(pLoad->start_event);
+    pLoad->start_event = NULL;
+
+    return (result);
+}
+
+static void wsvc_test_limiter_under_load()
+{
+    wsvc_limiter_limits limits;
+    wsvc_test_limiter_load load;
+    LONG const total = WSVC_TEST_LIMITER_LOAD_THREAD_COUNT * WSVC_TEST_LIMITER_LOAD_OPERATIONS_PER_THREAD;
+
+    ZeroMemory(&load, sizeof(wsvc_test_limiter_load));
+
+    wsvc_test_check(wsvc_test_limiter_run_load(&load), TEXT("run the load without the limiter"));
+    wsvc_test_check(load.admitted == total, TEXT("without the limiter all work runs"));
+    wsvc_test_check(
+        load.max_in_flight > WSVC_TEST_LIMITER_LOAD_CONCURRENCY,
+        TEXT("without the limiter the load exceeds the limit"));
+
+    // The limit stays fixed, and the queue has room for every thread that is not running.
+    wsvc_test_limiter_get_manual_limits(&limits);
+    limits.cpu_target_percent = 0;
+    limits.memory_limit_bytes = 0;
+    limits.max_concurrency = WSVC_TEST_LIMITER_LOAD_CONCURRENCY;
+    limits.initial_concurrency = WSVC_TEST_LIMITER_LOAD_CONCURRENCY;
+    limits.queue_percent = (WSVC_TEST_LIMITER_LOAD_THREAD_COUNT * 100) / WSVC_TEST_LIMITER_LOAD_CONCURRENCY;
+
+    ZeroMemory(&load, sizeof(wsvc_test_limiter_load));
+
+    wsvc_test_check(wsvc_limiter_create(&limits, &(load.limiter)) == WSVC_LIMITER_OK, TEXT("create the load limiter"));
+    if (load.limiter == NULL)
+        return;
+
+    wsvc_test_check(wsvc_test_limiter_run_load(&load), TEXT("run the load with the limiter"));
+    wsvc_test_check(load.admitted == total, TEXT("queued work was admitted rather than shed"));
+    wsvc_test_check(load.rejected == 0, TEXT("no work timed out in the admission queue"));
+    wsvc_test_check(
+        load.max_in_flight <= WSVC_TEST_LIMITER_LOAD_CONCURRENCY,
+        TEXT("with the limiter the load never exceeds the limit"));
+
+    wsvc_limiter_destroy(load.limiter);
+}
+
+void wsvc_test_limiter()
+{
+    wsvc_test_limiter_create();
+    wsvc_test_limiter_sampler();
+    wsvc_test_limiter_latency();
+    wsvc_test_limiter_window_overflow();
+    wsvc_test_limiter_under_load();
+}
@@ -0,0 +1,327 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_tests/test.h>
+
+#include <wsvc/snapshot.h>
+
+#include <string.h>
+#include <strsafe.h>
+
+#include <Windows.h>
+
+#define WSVC_TEST_SNAPSHOT_MAX_FILE_SIZE 4096
+#define WSVC_TEST_SNAPSHOT_BYTES_SIZE 64
+#define WSVC_TEST_SNAPSHOT_COUNTER_COUNT 4
+
+static LPCTSTR const WSVC_TEST_SNAPSHOT_FILE_NAME = TEXT("wsvc_test.snapshot");
+
+static DWORD const WSVC_TEST_SNAPSHOT_BYTES_ID = 1;
+static DWORD const WSVC_TEST_SNAPSHOT_BYTES_VERSION = 1;
+static DWORD const WSVC_TEST_SNAPSHOT_COUNTERS_ID = 2;
+static DWORD const WSVC_TEST_SNAPSHOT_COUNTERS_VERSION = 3;
+static DWORD const WSVC_TEST_SNAPSHOT_MISSING_ID = 99;
+
+// The snapshot header starts with the magic and format version DWORDs.
+static DWORD const WSVC_TEST_SNAPSHOT_FORMAT_VERSION_OFFSET = sizeof(DWORD);
+
+// The state that a component would keep across restarts. The counters region is registered last, so its data ends
+// the file.
+struct wsvc_test_snapshot_state_
+{
+    BYTE bytes[WSVC_TEST_SNAPSHOT_BYTES_SIZE];
+    ULONGLONG counters[WSVC_TEST_SNAPSHOT_COUNTER_COUNT];
+};
+
+typedef struct wsvc_test_snapshot_state_ wsvc_test_snapshot_state;
+
+static void wsvc_test_snapshot_progress(LPVOID pContext)
+{
+    ++(*((LONG*) pContext));
+}
+
+static bool wsvc_test_snapshot_get_path(LPTSTR path, size_t pathLength)
+{
+    DWORD tempPathLength = 0;
+
+    tempPathLength = GetTempPath((DWORD) pathLength, path);
+    if ((tempPathLength == 0) || (tempPathLength >= pathLength))
+        return (false);
+
+    return (SUCCEEDED(StringCchCat(path, pathLength, WSVC_TEST_SNAPSHOT_FILE_NAME)));
+}
+
+static void wsvc_test_snapshot_fill_state(wsvc_test_snapshot_state* pState)
+{
+    DWORD index = 0;
+
+    for (index = 0; index < WSVC_TEST_SNAPSHOT_BYTES_SIZE; ++index)
+        pState->bytes[index] = (BYTE) (index * 7);
+
+    for (index = 0; index < WSVC_TEST_SNAPSHOT_COUNTER_COUNT; ++index)
+        pState->counters[index] = 0x0123456789ABCDEF + index;
+}
+
+static bool wsvc_test_snapshot_save_state(LPCTSTR path, wsvc_test_snapshot_state const* pState, LONG* pProgressCount)
+{
+    wsvc_snapshot_ptr pSnapshot = NULL;
+    bool result = false;
+
+    if (wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK)
+        return (false);
+
+    if ((wsvc_snapshot_register(
+            pSnapshot,
+            WSVC_TEST_SNAPSHOT_BYTES_ID,
+            WSVC_TEST_SNAPSHOT_BYTES_VERSION,
+            pState->bytes,
+            sizeof(pState->bytes)) == WSVC_SNAPSHOT_OK) &&
+        (wsvc_snapshot_register(
+            pSnapshot,
+            WSVC_TEST_SNAPSHOT_COUNTERS_ID,
+            WSVC_TEST_SNAPSHOT_COUNTERS_VERSION,
+            pState->counters,
+            sizeof(pState->counters)) == WSVC_SNAPSHOT_OK))
+        result = (wsvc_snapshot_save(
+            pSnapshot,
+            path,
+            (pProgressCount != NULL) ? wsvc_test_snapshot_progress : NULL,
+            pProgressCount) == WSVC_SNAPSHOT_OK);
+
+    wsvc_snapshot_destroy(pSnapshot);
+
+    return (result);
+}
+
+static bool wsvc_test_snapshot_read_file(LPCTSTR path, BYTE* pBuffer, DWORD* pSize)
+{
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    BOOL readOk = FALSE;
+
+    hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+        return (false);
+
+    readOk = ReadFile(hFile, pBuffer, WSVC_TEST_SNAPSHOT_MAX_FILE_SIZE, pSize, NULL);
+
+    CloseHandle(hFile);
+
+    return ((readOk == TRUE) && (*pSize < WSVC_TEST_SNAPSHOT_MAX_FILE_SIZE));
+}
+
+static bool wsvc_test_snapshot_write_file(LPCTSTR path, BYTE const* pBuffer, DWORD size)
+{
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    DWORD bytesWritten = 0;
+    BOOL writeOk = FALSE;
+
+    hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+        return (false);
+
+    writeOk = WriteFile(hFile, pBuffer, size, &bytesWritten, NULL);
+
+    CloseHandle(hFile);
+
+    return ((writeOk == TRUE) && (bytesWritten == size));
+}
+
+// Checks that a snapshot which failed to load leaves nothing to restore, which is what makes the service start cold.
+static void wsvc_test_snapshot_check_cold_start(LPCTSTR path, LPCTSTR loadDescription, LPCTSTR restoreDescription)
+{
+    wsvc_snapshot_ptr pSnapshot = NULL;
+    LPCVOID pData = NULL;
+    SIZE_T size = 0;
+
+    if (wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK) {
+        wsvc_test_check(false, TEXT("create a snapshot"));
+        return;
+    }
+
+    wsvc_test_check(wsvc_snapshot_load(pSnapshot, path) == WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT, loadDescription);
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND,
+        restoreDescription);
+    wsvc_test_check(wsvc_snapshot_get_restored_count(pSnapshot) == 0, TEXT("nothing is restored on a cold start"));
+
+    wsvc_snapshot_destroy(pSnapshot);
+}
+
+static void wsvc_test_snapshot_round_trip(LPCTSTR path)
+{
+    wsvc_test_snapshot_state state;
+    wsvc_snapshot_ptr pSnapshot = NULL;
+    wsvc_snapshot_ptr pResaved = NULL;
+    LPCVOID pData = NULL;
+    SIZE_T size = 0;
+    LONG progressCount = 0;
+
+    ZeroMemory(&state, sizeof(wsvc_test_snapshot_state));
+    wsvc_test_snapshot_fill_state(&state);
+
+    wsvc_test_check(wsvc_test_snapshot_save_state(path, &state, &progressCount), TEXT("save a snapshot"));
+    wsvc_test_check(progressCount >= 2, TEXT("save reports progress for every region"));
+
+    if (wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK) {
+        wsvc_test_check(false, TEXT("create a snapshot"));
+        return;
+    }
+
+    wsvc_test_check(wsvc_snapshot_load(pSnapshot, path) == WSVC_SNAPSHOT_OK, TEXT("load the saved snapshot"));
+    wsvc_test_check(wsvc_snapshot_get_restored_count(pSnapshot) == 0, TEXT("nothing is restored until asked for"));
+
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_OK,
+        TEXT("restore the first region"));
+    wsvc_test_check(
+        (size == sizeof(state.bytes)) && (memcmp(pData, state.bytes, sizeof(state.bytes)) == 0),
+        TEXT("the first region round-trips unchanged"));
+
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_COUNTERS_ID, WSVC_TEST_SNAPSHOT_COUNTERS_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_OK,
+        TEXT("restore the second region"));
+    wsvc_test_check(
+        (size == sizeof(state.counters)) && (memcmp(pData, state.counters, sizeof(state.counters)) == 0),
+        TEXT("the second region round-trips unchanged"));
+    wsvc_test_check(wsvc_snapshot_get_restored_count(pSnapshot) == 2, TEXT("both regions count as restored"));
+
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_COUNTERS_ID, WSVC_TEST_SNAPSHOT_COUNTERS_VERSION - 1, &pData, &size) ==
+            WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND,
+        TEXT("a region version mismatch is treated as not found"));
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_MISSING_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_ERROR_REGION_NOT_FOUND,
+        TEXT("an unknown region is not found"));
+
+    // A component may register its restored region in place; the save must read it before the old file goes away.
+    if (wsvc_snapshot_create(&pResaved) == WSVC_SNAPSHOT_OK) {
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size);
+        wsvc_snapshot_register(pSnapshot, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, pData, size);
+
+        wsvc_test_check(
+            wsvc_snapshot_save(pSnapshot, path, NULL, NULL) == WSVC_SNAPSHOT_OK,
+            TEXT("save a region registered from the loaded snapshot"));
+        wsvc_test_check(wsvc_snapshot_load(pResaved, path) == WSVC_SNAPSHOT_OK, TEXT("load the re-saved snapshot"));
+        wsvc_test_check(
+            (wsvc_snapshot_restore(pResaved, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size) ==
+                WSVC_SNAPSHOT_OK) &&
+                (size == sizeof(state.bytes)) &&
+                (memcmp(pData, state.bytes, sizeof(state.bytes)) == 0),
+            TEXT("a region saved in place round-trips unchanged"));
+
+        wsvc_snapshot_destroy(pResaved);
+    }
+
+    wsvc_snapshot_destroy(pSnapshot);
+}
+
+static void wsvc_test_snapshot_corrupt_region(LPCTSTR path)
+{
+    wsvc_test_snapshot_state state;
+    wsvc_snapshot_ptr pSnapshot = NULL;
+    BYTE buffer[WSVC_TEST_SNAPSHOT_MAX_FILE_SIZE];
+    DWORD fileSize = 0;
+    LPCVOID pData = NULL;
+    SIZE_T size = 0;
+
+    ZeroMemory(&state, sizeof(wsvc_test_snapshot_state));
+    wsvc_test_snapshot_fill_state(&state);
+
+    if (!wsvc_test_snapshot_save_state(path, &state, NULL) || !wsvc_test_snapshot_read_file(path, buffer, &fileSize)) {
+        wsvc_test_check(false, TEXT("save and read back a snapshot"));
+        return;
+    }
+
+    buffer[fileSize - 1] = (BYTE) (buffer[fileSize - 1] ^ 0x01);
+
+    if (!wsvc_test_snapshot_write_file(path, buffer, fileSize) || (wsvc_snapshot_create(&pSnapshot) != WSVC_SNAPSHOT_OK)) {
+        wsvc_test_check(false, TEXT("write back a corrupted snapshot"));
+        return;
+    }
+
+    // Region data is only checked on restore, so the flipped byte does not stop the other region from loading.
+    wsvc_test_check(wsvc_snapshot_load(pSnapshot, path) == WSVC_SNAPSHOT_OK, TEXT("load a snapshot with a corrupted region"));
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_COUNTERS_ID, WSVC_TEST_SNAPSHOT_COUNTERS_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT,
+        TEXT("a flipped region byte fails the region checksum"));
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_COUNTERS_ID, WSVC_TEST_SNAPSHOT_COUNTERS_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_ERROR_INVALID_SNAPSHOT,
+        TEXT("a corrupted region stays invalid"));
+    wsvc_test_check(
+        wsvc_snapshot_restore(pSnapshot, WSVC_TEST_SNAPSHOT_BYTES_ID, WSVC_TEST_SNAPSHOT_BYTES_VERSION, &pData, &size) ==
+            WSVC_SNAPSHOT_OK,
+        TEXT("an intact region still restores"));
+    wsvc_test_check(wsvc_snapshot_get_restored_count(pSnapshot) == 1, TEXT("only the intact region counts as restored"));
+
+    wsvc_snapshot_destroy(pSnapshot);
+}
+
+static void wsvc_test_snapshot_invalid_file(LPCTSTR path)
+{
+    wsvc_test_snapshot_state state;
+    BYTE buffer[WSVC_TEST_SNAPSHOT_MAX_FILE_SIZE];
+    DWORD fileSize = 0;
+    DWORD formatVersion = 0;
+    wsvc_snapshot_ptr pSnapshot = NULL;
+
+    ZeroMemory(&state, sizeof(wsvc_test_snapshot_state));
+    wsvc_test_snapshot_fill_state(&state);
+
+    if (!wsvc_test_snapshot_save_state(path, &state, NULL) || !wsvc_test_snapshot_read_file(path, buffer, &fileSize)) {
+        wsvc_test_check(false, TEXT("save and read back a snapshot"));
+        return;
+    }
+
+    memcpy(&formatVersion, buffer + WSVC_TEST_SNAPSHOT_FORMAT_VERSION_OFFSET, sizeof(DWORD));
+    ++formatVersion;
+    memcpy(buffer + WSVC_TEST_SNAPSHOT_FORMAT_VERSION_OFFSET, &formatVersion, sizeof(DWORD));
+
+    wsvc_test_check(wsvc_test_snapshot_write_file(path, buffer, fileSize), TEXT("write back a snapshot with a newer format"));
+    wsvc_test_snapshot_check_cold_start(
+        path,
+        TEXT("a bumped format version is rejected"),
+        TEXT("a bumped format version restores nothing"));
+
+    // Undo the format change so that the truncation is the only problem with the file.
+    --formatVersion;
+    memcpy(buffer + WSVC_TEST_SNAPSHOT_FORMAT_VERSION_OFFSET, &formatVersion, sizeof(DWORD));
+
+    wsvc_test_check(wsvc_test_snapshot_write_file(path, buffer, fileSize - 1), TEXT("write back a truncated snapshot"));
+    wsvc_test_snapshot_check_cold_start(
+        path,
+        TEXT("a truncated snapshot is rejected"),
+        TEXT("a truncated snapshot restores nothing"));
+
+    DeleteFile(path);
+
+    if (wsvc_snapshot_create(&pSnapshot) == WSVC_SNAPSHOT_OK) {
+        wsvc_test_check(
+            wsvc_snapshot_load(pSnapshot, path) == WSVC_SNAPSHOT_ERROR_FAILED_TO_OPEN_FILE,
+            TEXT("a missing snapshot fails to open"));
+        wsvc_snapshot_destroy(pSnapshot);
+    }
+}
+
+void wsvc_test_snapshot()
+{
+    TCHAR path[MAX_PATH];
+
+    ZeroMemory(path, sizeof(TCHAR) * _countof(path));
+
+    if (!wsvc_test_snapshot_get_path(path, _countof(path))) {
+        wsvc_test_check(false, TEXT("resolve a temporary snapshot path"));
+        return;
+    }
+
+    wsvc_test_snapshot_round_trip(path);
+    wsvc_test_snapshot_corrupt_region(path);
+    wsvc_test_snapshot_invalid_file(path);
+
+    DeleteFile(path);
+}
@@ -0,0 +1,348 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_tests/test.h>
+
+#include <wsvc/state.h>
+
+#include <Windows.h>
+
+#define WSVC_TEST_THREAD_COUNT 8
+#define WSVC_TEST_READER_COUNT 2
+#define WSVC_TEST_SUBSCRIPTIONS_PER_THREAD 3
+#define WSVC_TEST_OBSERVER_CONTEXT_COUNT (WSVC_TEST_THREAD_COUNT * WSVC_TEST_SUBSCRIPTIONS_PER_THREAD)
+
+// Must match WSVC_STATE_MAX_OBSERVERS in state.c.
+static LONG const WSVC_TEST_MAX_OBSERVERS = 16;
+
+// Kept low enough that the checkpoint never wraps over the whole test.
+static LONG const WSVC_TEST_TRANSITIONS_PER_THREAD = 50000;
+
+// Spacing between subscriptions so that they land in the middle of the transition storm.
+static LONG const WSVC_TEST_SUBSCRIPTION_INTERVAL = 1000;
+
+struct wsvc_test_observer_context_
+{
+    LONG volatile notifications;
+    LONG volatile errors;
+    LONG volatile subscribed;
+};
+
+typedef struct wsvc_test_observer_context_ wsvc_test_observer_context;
+typedef wsvc_test_observer_context* wsvc_test_observer_context_ptr;
+
+struct wsvc_test_worker_
+{
+    DWORD target_state;
+    LONG transitions;
+    LONG subscriptions;
+};
+
+typedef struct wsvc_test_worker_ wsvc_test_worker;
+
+static HANDLE wsvc_test_start_event = NULL;
+
+static LONG volatile wsvc_test_order_errors = 0;
+
+static LONG volatile wsvc_test_readers_stop = 0;
+static LONG volatile wsvc_test_readers_sampled = 0;
+static LONG volatile wsvc_test_reader_errors = 0;
+
+static LONG volatile wsvc_test_transition_ok = 0;
+static LONG volatile wsvc_test_transition_invalid = 0;
+static LONG volatile wsvc_test_transition_other = 0;
+static LONG volatile wsvc_test_subscribe_ok = 0;
+static LONG volatile wsvc_test_subscribe_full = 0;
+static LONG volatile wsvc_test_subscribe_other = 0;
+
+static wsvc_test_observer_context wsvc_test_observer_contexts[WSVC_TEST_OBSERVER_CONTEXT_COUNT];
+static LONG volatile wsvc_test_observer_context_next = 0;
+
+static void wsvc_test_observer(DWORD fromState, DWORD toState, DWORD checkpoint, LPVOID pContext)
+{
+    wsvc_test_observer_context_ptr pObserverContext = (wsvc_test_observer_context_ptr) pContext;
+    LONG stateWord = 0;
+
+    UNREFERENCED_PARAMETER(fromState);
+
+    InterlockedIncrement(&(pObserverContext->notifications));
+
+    // Observers are only called once the transition has been published. Every thread in a round moves to the same
+    // state and checkpoints only grow within it, so the current word can never be behind the one being notified.
+    stateWord = wsvc_state_get_word();
+
+    if ((wsvc_state_word_get_state(stateWord) != toState) || (wsvc_state_word_get_checkpoint(stateWord) < checkpoint))
+        InterlockedIncrement(&(pObserverContext->errors));
+}
+
+static void wsvc_test_subscribe()
+{
+    LONG index = 0;
+    int result = WSVC_STATE_ERROR;
+
+    index = InterlockedIncrement(&wsvc_test_observer_context_next) - 1;
+    if (index >= WSVC_TEST_OBSERVER_CONTEXT_COUNT)
+        return;
+
+    result = wsvc_state_subscribe(wsvc_test_observer, &(wsvc_test_observer_contexts[index]));
+
+    if (result == WSVC_STATE_OK) {
+        InterlockedExchange(&(wsvc_test_observer_contexts[index].subscribed), 1);
+        InterlockedIncrement(&wsvc_test_subscribe_ok);
+    }
+    else if (result == WSVC_STATE_ERROR_TOO_MANY_OBSERVERS) {
+        InterlockedIncrement(&wsvc_test_subscribe_full);
+    }
+    else {
+        InterlockedIncrement(&wsvc_test_subscribe_other);
+    }
+}
+
+static DWORD WINAPI wsvc_test_worker_main(LPVOID pParameter)
+{
+    wsvc_test_worker const* pWorker = (wsvc_test_worker const*) pParameter;
+    LONG index = 0;
+    LONG subscriptions = 0;
+    LONG stateWord = 0;
+    DWORD lastCheckpoint = 0;
+    int result = WSVC_STATE_ERROR;
+
+    WaitForSingleObject(wsvc_test_start_event, INFINITE);
+
+    for (index = 0; index < pWorker->transitions; ++index) {
+        if ((subscriptions < pWorker->subscriptions) && ((index % WSVC_TEST_SUBSCRIPTION_INTERVAL) == 0)) {
+            wsvc_test_subscribe();
+            ++subscriptions;
+        }
+
+        result = wsvc_state_transition(pWorker->target_state, &stateWord);
+
+        if (result == WSVC_STATE_OK) {
+            InterlockedIncrement(&wsvc_test_transition_ok);
+
+            // Each of this thread's transitions happens after its previous one, so within a round of repeated
+            // pending transitions the checkpoints it gets back must strictly increase.
+            if ((wsvc_state_word_get_checkpoint(stateWord) != 0) && (wsvc_state_word_get_checkpoint(stateWord) <= lastCheckpoint))
+                InterlockedIncrement(&wsvc_test_order_errors);
+
+            lastCheckpoint = wsvc_state_word_get_checkpoint(stateWord);
+        }
+        else if (result == WSVC_STATE_ERROR_INVALID_TRANSITION)
+            InterlockedIncrement(&wsvc_test_transition_invalid);
+        else
+            InterlockedIncrement(&wsvc_test_transition_other);
+    }
+
+    return (0);
+}
+
+// Reads the state word while the workers are bumping the start checkpoint. Every read must be a start pending word,
+// and since the checkpoint only grows during the storm, no reader may ever see it go backwards.
+static DWORD WINAPI wsvc_test_reader_main(LPVOID pParameter)
+{
+    LONG stateWord = 0;
+    DWORD checkpoint = 0;
+    DWORD lastCheckpoint = 0;
+    bool sampled = false;
+
+    UNREFERENCED_PARAMETER(pParameter);
+
+    while (ReadAcquire(&wsvc_test_readers_stop) == 0) {
+        stateWord = wsvc_state_get_word();
+        checkpoint = wsvc_state_word_get_checkpoint(stateWord);
+
+        if ((wsvc_state_word_get_state(stateWord) != SERVICE_START_PENDING) || (checkpoint == 0) || (checkpoint < lastCheckpoint))
+            InterlockedIncrement(&wsvc_test_reader_errors);
+
+        lastCheckpoint = checkpoint;
+        sampled = true;
+    }
+
+    if (sampled)
+        InterlockedIncrement(&wsvc_test_readers_sampled);
+
+    return (0);
+}
+
+// Runs WSVC_TEST_THREAD_COUNT threads that all attempt the same transitions at once.
+static bool wsvc_test_run_threads(DWORD targetState, LONG transitions, LONG subscriptions)
+{
+    bool result = true;
+    HANDLE threads[WSVC_TEST_THREAD_COUNT];
+    DWORD threadCount = 0;
+    wsvc_test_worker worker;
+
+    ZeroMemory(threads, sizeof(threads));
+    ZeroMemory(&worker, sizeof(wsvc_test_worker));
+
+    worker.target_state = targetState;
+    worker.transitions = transitions;
+    worker.subscriptions = subscriptions;
+
+    InterlockedExchange(&wsvc_test_transition_ok, 0);
+    InterlockedExchange(&wsvc_test_transition_invalid, 0);
+
+    ResetEvent(wsvc_test_start_event);
+
+    for (threadCount = 0; threadCount < WSVC_TEST_THREAD_COUNT; ++threadCount) {
+        threads[threadCount] = CreateThread(NULL, 0, wsvc_test_worker_main, &worker, 0, NULL);
+
+        if (threads[threadCount] == NULL) {
+            result = false;
+            break;
+        }
+    }
+
+    // Release all threads together so that their transitions contend on the state word.
+    SetEvent(wsvc_test_start_event);
+
+    if (threadCount > 0)
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+    while (threadCount > 0)
+        CloseHandle(threads[--threadCount]);
+
+    return (result);
+}
+
+static LONG wsvc_test_sum_notifications(LONG* pNotifications)
+{
+    LONG index = 0;
+    LONG errors = 0;
+
+    for (index = 0; index < WSVC_TEST_OBSERVER_CONTEXT_COUNT; ++index) {
+        pNotifications[index] = wsvc_test_observer_contexts[index].notifications;
+        errors += wsvc_test_observer_contexts[index].errors;
+    }
+
+    return (errors);
+}
+
+static bool wsvc_test_notifications_advanced_by(LONG const* pBefore, LONG expected)
+{
+    LONG index = 0;
+
+    for (index = 0; index < WSVC_TEST_OBSERVER_CONTEXT_COUNT; ++index) {
+        if (wsvc_test_observer_contexts[index].subscribed == 0)
+            continue;
+
+        if ((wsvc_test_observer_contexts[index].notifications - pBefore[index]) != expected)
+            return (false);
+    }
+
+    return (true);
+}
+
+void wsvc_test_state()
+{
+    LONG notifications[WSVC_TEST_OBSERVER_CONTEXT_COUNT];
+    HANDLE readers[WSVC_TEST_READER_COUNT];
+    DWORD readerCount = 0;
+    LONG stateWord = 0;
+    LONG expectedCheckpoint = 0;
+
+    ZeroMemory(notifications, sizeof(notifications));
+    ZeroMemory(readers, sizeof(readers));
+
+    wsvc_test_start_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    wsvc_test_check(wsvc_test_start_event != NULL, TEXT("create the state test start event"));
+    if (wsvc_test_start_event == NULL)
+        return;
+
+    wsvc_test_check(wsvc_state_get_current() == WSVC_STATE_NOT_STARTED, TEXT("initial state is not started"));
+    wsvc_test_check(wsvc_state_is_stopping() == FALSE, TEXT("not stopping before the first start"));
+    wsvc_test_check(
+        wsvc_state_transition(SERVICE_RUNNING, NULL) == WSVC_STATE_ERROR_INVALID_TRANSITION,
+        TEXT("cannot run before starting"));
+
+    wsvc_test_check(wsvc_state_transition(SERVICE_START_PENDING, &stateWord) == WSVC_STATE_OK, TEXT("start"));
+    wsvc_test_check(wsvc_state_word_get_checkpoint(stateWord) == 1, TEXT("start begins at checkpoint 1"));
+    wsvc_test_check(
+        wsvc_state_transition(SERVICE_STOP_PENDING, NULL) == WSVC_STATE_ERROR_INVALID_TRANSITION,
+        TEXT("cannot stop while starting"));
+
+    // Checkpoint bumps racing with observer registration, with more registrations than there are slots, while
+    // reader threads validate every word they see.
+    for (readerCount = 0; readerCount < WSVC_TEST_READER_COUNT; ++readerCount) {
+        readers[readerCount] = CreateThread(NULL, 0, wsvc_test_reader_main, NULL, 0, NULL);
+
+        if (readers[readerCount] == NULL)
+            break;
+    }
+
+    wsvc_test_check(readerCount == WSVC_TEST_READER_COUNT, TEXT("start the state word readers"));
+
+    wsvc_test_check(
+        wsvc_test_run_threads(SERVICE_START_PENDING, WSVC_TEST_TRANSITIONS_PER_THREAD, WSVC_TEST_SUBSCRIPTIONS_PER_THREAD),
+        TEXT("contended checkpoint bumps with subscriptions"));
+
+    InterlockedExchange(&wsvc_test_readers_stop, 1);
+
+    if (readerCount > 0)
+        WaitForMultipleObjects(readerCount, readers, TRUE, INFINITE);
+
+    while (readerCount > 0)
+        CloseHandle(readers[--readerCount]);
+
+    wsvc_test_check(wsvc_test_readers_sampled > 0, TEXT("readers sampled the state word during the storm"));
+    wsvc_test_check(
+        wsvc_test_reader_errors == 0,
+        TEXT("readers only saw start pending words with a checkpoint that never went backwards"));
+
+    expectedCheckpoint = 1 + (WSVC_TEST_THREAD_COUNT * WSVC_TEST_TRANSITIONS_PER_THREAD);
+
+    wsvc_test_check(
+        wsvc_test_transition_ok == (WSVC_TEST_THREAD_COUNT * WSVC_TEST_TRANSITIONS_PER_THREAD),
+        TEXT("every checkpoint bump succeeded"));
+    wsvc_test_check(
+        wsvc_state_word_get_checkpoint(wsvc_state_get_word()) == (DWORD) expectedCheckpoint,
+        TEXT("no checkpoint bump was lost"));
+    wsvc_test_check(wsvc_test_subscribe_ok == WSVC_TEST_MAX_OBSERVERS, TEXT("every observer slot was filled exactly once"));
+    wsvc_test_check(
+        wsvc_test_subscribe_full == (WSVC_TEST_OBSERVER_CONTEXT_COUNT - WSVC_TEST_MAX_OBSERVERS),
+        TEXT("surplus subscriptions were refused"));
+    wsvc_test_check(wsvc_test_subscribe_other == 0, TEXT("no subscription failed unexpectedly"));
+
+    // With the observer set fixed, every observer must see every transition.
+    wsvc_test_sum_notifications(notifications);
+
+    wsvc_test_run_threads(SERVICE_START_PENDING, WSVC_TEST_TRANSITIONS_PER_THREAD, 0);
+
+    wsvc_test_check(
+        wsvc_test_notifications_advanced_by(notifications, WSVC_TEST_THREAD_COUNT * WSVC_TEST_TRANSITIONS_PER_THREAD),
+        TEXT("observers saw every contended transition"));
+
+    // Only one thread can win a transition that is not allowed to repeat.
+    wsvc_test_sum_notifications(notifications);
+
+    wsvc_test_run_threads(SERVICE_RUNNING, 1, 0);
+
+    wsvc_test_check(wsvc_test_transition_ok == 1, TEXT("exactly one thread entered running"));
+    wsvc_test_check(
+        wsvc_test_transition_invalid == (WSVC_TEST_THREAD_COUNT - 1),
+        TEXT("the other threads were refused"));
+    wsvc_test_check(wsvc_state_word_get_checkpoint(wsvc_state_get_word()) == 0, TEXT("running clears the checkpoint"));
+    wsvc_test_check(wsvc_state_is_stopping() == FALSE, TEXT("not stopping while running"));
+    wsvc_test_check(wsvc_test_notifications_advanced_by(notifications, 1), TEXT("observers saw the single win"));
+
+    // Stop pending may repeat, so every thread succeeds and advances the checkpoint once.
+    wsvc_test_run_threads(SERVICE_STOP_PENDING, 1, 0);
+
+    wsvc_test_check(wsvc_test_transition_ok == WSVC_TEST_THREAD_COUNT, TEXT("every thread advanced stop pending"));
+    wsvc_test_check(
+        wsvc_state_word_get_checkpoint(wsvc_state_get_word()) == WSVC_TEST_THREAD_COUNT,
+        TEXT("stop pending checkpoint counts every thread"));
+    wsvc_test_check(wsvc_state_is_stopping() == TRUE, TEXT("stopping once stop is pending"));
+
+    wsvc_test_run_threads(SERVICE_STOPPED, 1, 0);
+
+    wsvc_test_check(wsvc_test_transition_ok == 1, TEXT("exactly one thread stopped the service"));
+    wsvc_test_check(wsvc_state_get_current() == SERVICE_STOPPED, TEXT("service is stopped"));
+    wsvc_test_check(wsvc_state_is_stopping() == TRUE, TEXT("still stopping once stopped"));
+
+    wsvc_test_check(wsvc_test_transition_other == 0, TEXT("no transition failed unexpectedly"));
+    wsvc_test_check(wsvc_test_sum_notifications(notifications) == 0, TEXT("observers were only called once the word was published"));
+    wsvc_test_check(wsvc_test_order_errors == 0, TEXT("each thread got strictly increasing checkpoints back"));
+
+    CloseHandle(wsvc_test_start_event);
+}
@@ -0,0 +1,22 @@
+// Copyright (c) Vincent Ycasas
+// SPDX-License-Identifier: MIT
+
+#include <wsvc_tests/test.h>
+
+#include <stdio.h>
+#include <tchar.h>
+
+static int wsvc_test_failures = 0;
+
+void wsvc_test_check(bool condition, LPCTSTR description)
+{
+    if (!condition)
+        ++wsvc_test_failures;
+
+    _tprintf(TEXT("[WSVC TEST] %s: %s\n"), condition ? TEXT("PASS") : TEXT("FAIL"), description);
+}
+
+int wsvc_test_get_failures()
+{
+    return (wsvc_test_failures);
+}